@@ -5,12 +5,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include <fftw3.h>
 
+#include "resample.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #if LUA_VERSION_NUM >= 503
 #define luaL_checklong(L,n)     ((long)luaL_checkinteger(L, (n)))
 #define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)      ((int)luaL_optinteger(L, (n), (d)))
 #endif
 
 void abort_(const char * s, ...)
@@ -27,6 +35,1091 @@ void abort_(const char * s, ...)
 #define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
 #define audio_(NAME) TH_CONCAT_3(audio_, Real, NAME)
 
+////////////////////////////////////////////////////////////////////////////
+// FFTW plan cache.
+// Plans are made once per (kind, precision, size, batch layout, planner
+// rigor) and kept for the life of the process. They are always executed with
+// the new-array interface (fftw_execute_dft_r2c etc.) on fftw_malloc'd
+// buffers, which is thread-safe; only the planner itself needs
+// audio_plan_lock. The makers live in generic/audio.c, one per precision.
+enum {
+  AUDIO_PLAN_R2C = 1,
+  AUDIO_PLAN_R2C_MANY,
+  AUDIO_PLAN_DCT2,
+  AUDIO_PLAN_C2R
+};
+
+typedef struct {
+  int kind;
+  int single;     // 1 for an fftwf_plan, 0 for an fftw_plan
+  long n;         // transform size
+  long howmany;   // number of transforms per execution
+  unsigned flags; // planner rigor
+} audio_plan_key_t;
+
+typedef struct audio_plan_entry {
+  audio_plan_key_t key;
+  void *plan;
+  struct audio_plan_entry *next;
+} audio_plan_entry_t;
+
+typedef void *(*audio_plan_maker_t)(const audio_plan_key_t *key);
+
+static audio_plan_entry_t *audio_plans = NULL;
+static pthread_mutex_t audio_plan_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned audio_planner_flags = FFTW_ESTIMATE;
+
+// Look the plan up, or make and cache it. Never returns NULL.
+static void *audio_plan_get(const audio_plan_key_t *key, audio_plan_maker_t make)
+{
+  audio_plan_entry_t *e;
+  void *plan = NULL;
+  pthread_mutex_lock(&audio_plan_lock);
+  for (e = audio_plans; e; e = e->next) {
+    if (e->key.kind == key->kind && e->key.single == key->single
+        && e->key.n == key->n && e->key.howmany == key->howmany
+        && e->key.flags == key->flags) {
+      plan = e->plan;
+      break;
+    }
+  }
+  if (plan == NULL) {
+    plan = make(key);
+    if (plan) {
+      e = (audio_plan_entry_t *)malloc(sizeof(audio_plan_entry_t));
+      e->key = *key;
+      e->plan = plan;
+      e->next = audio_plans;
+      audio_plans = e;
+    }
+  }
+  pthread_mutex_unlock(&audio_plan_lock);
+  if (plan == NULL)
+    THError("[fftw] could not create a plan of %ld transforms of size %ld",
+            key->howmany, key->n);
+  return plan;
+}
+
+static void audio_plan_clear(void)
+{
+  pthread_mutex_lock(&audio_plan_lock);
+  while (audio_plans) {
+    audio_plan_entry_t *e = audio_plans;
+    audio_plans = e->next;
+    if (e->key.single)
+      fftwf_destroy_plan((fftwf_plan)e->plan);
+    else
+      fftw_destroy_plan((fftw_plan)e->plan);
+    free(e);
+  }
+  pthread_mutex_unlock(&audio_plan_lock);
+}
+
+// arguments [rigor: estimate, measure, patient or exhaustive]
+// returns [previous rigor]
+static int audio_fftw_planner(lua_State *L)
+{
+  static const char *names[] = {"estimate", "measure", "patient", "exhaustive", NULL};
+  static const unsigned flags[] = {FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, FFTW_EXHAUSTIVE};
+  int i;
+  for (i = 0; names[i]; i++)
+    if (flags[i] == audio_planner_flags)
+      lua_pushstring(L, names[i]);
+  if (lua_isnoneornil(L, 1))
+    return 1;
+  const char *rigor = luaL_checkstring(L, 1);
+  for (i = 0; names[i]; i++) {
+    if (strcmp(rigor, names[i]) == 0) {
+      audio_planner_flags = flags[i];
+      return 1;
+    }
+  }
+  return luaL_error(L, "unknown planner rigor '%s' (estimate, measure, patient, exhaustive)", rigor);
+}
+
+// Wisdom files hold the double precision wisdom, a NUL, then the single
+// precision wisdom. A plain fftw wisdom file loads as double precision.
+// arguments [path] returns [true on success]
+static int audio_fftw_wisdom_save(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  int ok = 0;
+  pthread_mutex_lock(&audio_plan_lock);
+  char *wisdom = fftw_export_wisdom_to_string();
+  char *wisdomf = fftwf_export_wisdom_to_string();
+  FILE *f = fopen(path, "wb");
+  if (f && wisdom && wisdomf) {
+    ok = fwrite(wisdom, strlen(wisdom) + 1, 1, f) == 1
+      && fwrite(wisdomf, strlen(wisdomf) + 1, 1, f) == 1;
+  }
+  if (f)
+    ok = (fclose(f) == 0) && ok;
+  fftw_free(wisdom);
+  fftw_free(wisdomf);
+  pthread_mutex_unlock(&audio_plan_lock);
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+// arguments [path] returns [true on success]
+// Plans already in the cache are kept; new plans will use the wisdom.
+static int audio_fftw_wisdom_load(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = (char *)malloc(size + 2);
+  int ok = size > 0 && fread(data, size, 1, f) == 1;
+  fclose(f);
+  if (ok) {
+    data[size] = data[size + 1] = '\0';
+    size_t first = strlen(data);
+    pthread_mutex_lock(&audio_plan_lock);
+    ok = fftw_import_wisdom_from_string(data);
+    if (ok && (long)first < size)
+      ok = fftwf_import_wisdom_from_string(data + first + 1);
+    pthread_mutex_unlock(&audio_plan_lock);
+  }
+  free(data);
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+static int audio_fftw_cache_clear(lua_State *L)
+{
+  audio_plan_clear();
+  return 0;
+}
+
+static const struct luaL_Reg audio_fftw__ [] = {
+  {"fftw_planner", audio_fftw_planner},
+  {"fftw_wisdom_save", audio_fftw_wisdom_save},
+  {"fftw_wisdom_load", audio_fftw_wisdom_load},
+  {"fftw_cache_clear", audio_fftw_cache_clear},
+  {NULL, NULL}
+};
+// End of FFTW plan cache section
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846264338327950288
+#endif
+
+////////////////////////////////////////////////////////////////////////////
+// Window tables.
+// Coefficients are computed once per (type, size) and kept for the life of
+// the process, so the frame loops only do a multiply per sample.
+// window_type [1, 2, 3, 4, 5, 6] for
+// [rectangular, hamming, hann, bartlett, blackman-harris, sqrt-hann]
+#define AUDIO_NWINDOWS 6
+
+typedef struct audio_window_entry {
+  int type;
+  long size;
+  double *coef;   // for the double precision transforms
+  float *coeff;   // the same table for the single precision ones
+  struct audio_window_entry *next;
+} audio_window_entry_t;
+
+static audio_window_entry_t *audio_windows = NULL;
+static pthread_mutex_t audio_window_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void audio_window_fill(double *w, long window_size, int window_type)
+{
+  long i, m = window_size - 1;
+  for (i = 0; i < window_size; ++i) {
+    // a single-sample window is flat whatever its type
+    double c = m > 0 ? cos(2 * M_PI * i / m) : 1;
+    switch (window_type) {
+    case 1: // Rectangular Window
+      w[i] = 1;
+      break;
+    case 2: // Hamming Window
+      w[i] = .53836 - .46164 * c;
+      break;
+    case 3: // Hann Window
+      w[i] = .5 - .5 * c;
+      break;
+    case 4: // Bartlett Window
+      w[i] = m > 0 ? 2. / m * (m / 2. - fabs(i - m / 2.)) : 1;
+      break;
+    case 5: // 4-term Blackman-Harris Window
+      w[i] = m > 0 ? .35875 - .48829 * c + .14128 * cos(4 * M_PI * i / m)
+        - .01168 * cos(6 * M_PI * i / m) : 1;
+      break;
+    case 6: // square root of the Hann Window, for analysis/synthesis pairs
+      w[i] = sqrt(fmax(0, .5 - .5 * c));
+      break;
+    }
+  }
+}
+
+static const audio_window_entry_t *audio_window(int window_type, long window_size)
+{
+  if (window_type < 1 || window_type > AUDIO_NWINDOWS)
+    THError("[window] Unknown window_type");
+  audio_window_entry_t *e;
+  pthread_mutex_lock(&audio_window_lock);
+  for (e = audio_windows; e; e = e->next)
+    if (e->type == window_type && e->size == window_size)
+      break;
+  if (e == NULL) {
+    e = (audio_window_entry_t *)malloc(sizeof(audio_window_entry_t));
+    e->type = window_type;
+    e->size = window_size;
+    e->coef = (double *)fftw_malloc(sizeof(double) * window_size);
+    e->coeff = (float *)fftwf_malloc(sizeof(float) * window_size);
+    audio_window_fill(e->coef, window_size, window_type);
+    long i;
+    for (i = 0; i < window_size; i++)
+      e->coeff[i] = (float)e->coef[i];
+    e->next = audio_windows;
+    audio_windows = e;
+  }
+  pthread_mutex_unlock(&audio_window_lock);
+  return e;
+}
+// End of window tables section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Overlap-add normalization for the inverse STFT.
+// Frames are windowed again after the inverse FFT and summed, and every
+// output sample is divided by the sum of the squared windows that covered
+// it. Away from the ends that sum is periodic in the hop; within
+// window_size - hop samples of either end fewer frames contribute. Both
+// are tabulated once per (type, size, hop), as reciprocals; only signals
+// too short to have an interior are summed on the fly.
+typedef struct audio_ola_entry {
+  int type;
+  long size, hop;
+  const audio_window_entry_t *window;
+  double *period;  // hop samples, away from both ends
+  double *head;    // size - hop samples from the start
+  double *tail;    // size - hop samples from the end, nearest the end first
+  struct audio_ola_entry *next;
+} audio_ola_entry_t;
+
+static audio_ola_entry_t *audio_olas = NULL;
+static pthread_mutex_t audio_ola_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// sums below this are left unnormalized: nothing can be recovered there
+#define AUDIO_OLA_EPS 1e-10
+
+static double audio_ola_recip(double sum)
+{
+  return sum > AUDIO_OLA_EPS ? 1 / sum : 1;
+}
+
+static const audio_ola_entry_t *audio_ola(int window_type, long window_size, long hop)
+{
+  if (hop <= 0 || hop > window_size)
+    THError("[istft] stride should be between 1 and window_size");
+  const audio_window_entry_t *window = audio_window(window_type, window_size);
+  audio_ola_entry_t *e;
+  pthread_mutex_lock(&audio_ola_lock);
+  for (e = audio_olas; e; e = e->next)
+    if (e->type == window_type && e->size == window_size && e->hop == hop)
+      break;
+  if (e == NULL) {
+    const double *w = window->coef;
+    const long edge = window_size - hop;
+    long n, k;
+    e = (audio_ola_entry_t *)malloc(sizeof(audio_ola_entry_t));
+    e->type = window_type;
+    e->size = window_size;
+    e->hop = hop;
+    e->window = window;
+    e->period = (double *)malloc(sizeof(double) * hop);
+    e->head = (double *)malloc(sizeof(double) * (edge > 0 ? edge : 1));
+    e->tail = (double *)malloc(sizeof(double) * (edge > 0 ? edge : 1));
+    for (n = 0; n < hop; n++) {
+      double sum = 0;
+      for (k = n; k < window_size; k += hop)
+        sum += w[k] * w[k];
+      e->period[n] = audio_ola_recip(sum);
+    }
+    for (n = 0; n < edge; n++) {
+      double head = 0, tail = 0;
+      for (k = n; k >= 0; k -= hop) {
+        head += w[k] * w[k];
+        tail += w[window_size - 1 - k] * w[window_size - 1 - k];
+      }
+      e->head[n] = audio_ola_recip(head);
+      e->tail[n] = audio_ola_recip(tail);
+    }
+    e->next = audio_olas;
+    audio_olas = e;
+  }
+  pthread_mutex_unlock(&audio_ola_lock);
+  return e;
+}
+
+// reciprocal of the window sum at sample n of nframes overlap-added frames
+static double audio_ola_norm(const audio_ola_entry_t *e, long n, long nframes)
+{
+  const long size = e->size, hop = e->hop, edge = size - hop;
+  const long length = (nframes - 1) * hop + size;
+  const int head = n < edge, tail = n >= length - edge;
+  if (head && tail) {
+    const double *w = e->window->coef;
+    long k = n - size + 1 > 0 ? (n - size + hop) / hop : 0;
+    double sum = 0;
+    for (; k < nframes && k * hop <= n; k++)
+      sum += w[n - k * hop] * w[n - k * hop];
+    return audio_ola_recip(sum);
+  }
+  if (head)
+    return e->head[n];
+  if (tail)
+    return e->tail[length - 1 - n];
+  return e->period[n % hop];
+}
+// End of overlap-add normalization section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Mel filterbanks.
+// Triangular filters on the HTK mel scale, mel(f) = 2595 log10(1 + f/700),
+// over the n_fft/2+1 bins of an n_fft point transform. Each filter only
+// touches the bins between its neighbours' centres, so a filter is stored
+// as its first bin and a run of weights. Filterbanks are built once per
+// (sample rate, n_fft, n_mels, fmin, fmax) and kept for the life of the
+// process, like the window tables.
+typedef struct audio_mel_entry {
+  double sample_rate, fmin, fmax;
+  long n_fft;
+  int n_mels;
+  long *start;    // first bin of each filter
+  long *count;    // number of bins of each filter
+  double **coef;  // weights of each filter, count[j] of them
+  struct audio_mel_entry *next;
+} audio_mel_entry_t;
+
+static audio_mel_entry_t *audio_mels = NULL;
+static pthread_mutex_t audio_mel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double audio_hz_to_mel(double f)
+{
+  return 2595 * log10(1 + f / 700);
+}
+
+static double audio_mel_to_hz(double m)
+{
+  return 700 * (pow(10, m / 2595) - 1);
+}
+
+static void audio_mel_fill(audio_mel_entry_t *e)
+{
+  const long nbins = e->n_fft / 2 + 1;
+  const double lo = audio_hz_to_mel(e->fmin), hi = audio_hz_to_mel(e->fmax);
+  int j;
+  e->start = (long *)malloc(sizeof(long) * e->n_mels);
+  e->count = (long *)malloc(sizeof(long) * e->n_mels);
+  e->coef = (double **)malloc(sizeof(double *) * e->n_mels);
+  for (j = 0; j < e->n_mels; j++) {
+    double left = audio_mel_to_hz(lo + (hi - lo) * j / (e->n_mels + 1));
+    double center = audio_mel_to_hz(lo + (hi - lo) * (j + 1) / (e->n_mels + 1));
+    double right = audio_mel_to_hz(lo + (hi - lo) * (j + 2) / (e->n_mels + 1));
+    long first = nbins, last = -1, k;
+    for (k = 0; k < nbins; k++) {
+      double f = (double)k * e->sample_rate / e->n_fft;
+      if (f > left && f < right) {
+        if (first == nbins)
+          first = k;
+        last = k;
+      }
+    }
+    e->start[j] = first < nbins ? first : 0;
+    e->count[j] = last - first + 1 > 0 ? last - first + 1 : 0;
+    e->coef[j] = (double *)malloc(sizeof(double) * (e->count[j] > 0 ? e->count[j] : 1));
+    for (k = 0; k < e->count[j]; k++) {
+      double f = (double)(first + k) * e->sample_rate / e->n_fft;
+      e->coef[j][k] = f <= center ? (f - left) / (center - left)
+                                  : (right - f) / (right - center);
+    }
+  }
+}
+
+static const audio_mel_entry_t *audio_mel(double sample_rate, long n_fft, int n_mels,
+                                          double fmin, double fmax)
+{
+  if (sample_rate <= 0 || n_mels < 1)
+    THError("[mel] sample_rate and n_mels should be positive");
+  if (fmin < 0 || fmax <= fmin || fmax > sample_rate / 2)
+    THError("[mel] frequency range should satisfy 0 <= fmin < fmax <= sample_rate/2");
+  audio_mel_entry_t *e;
+  pthread_mutex_lock(&audio_mel_lock);
+  for (e = audio_mels; e; e = e->next)
+    if (e->sample_rate == sample_rate && e->n_fft == n_fft && e->n_mels == n_mels
+        && e->fmin == fmin && e->fmax == fmax)
+      break;
+  if (e == NULL) {
+    e = (audio_mel_entry_t *)malloc(sizeof(audio_mel_entry_t));
+    e->sample_rate = sample_rate;
+    e->fmin = fmin;
+    e->fmax = fmax;
+    e->n_fft = n_fft;
+    e->n_mels = n_mels;
+    audio_mel_fill(e);
+    e->next = audio_mels;
+    audio_mels = e;
+  }
+  pthread_mutex_unlock(&audio_mel_lock);
+  return e;
+}
+// End of mel filterbanks section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Constant-Q kernels and the octave decimation filter, after
+// Schoerkhuber and Klapuri, "Constant-Q transform toolbox for music
+// processing" (SMC 2010), http://www.eecs.qmul.ac.uk/~anssik/cqt/
+//
+// The kernel covers the top octave only: bins atoms per frequency, each
+// a sqrt-blackman-harris windowed complex exponential, repeated at atoms
+// hops of atom_hop samples inside an fft_len frame. Its spectrum is
+// thresholded and stored sparsely, conjugated and normalized, so that one
+// coefficient is a short dot product with an fft_len point spectrum. Lower
+// octaves reuse it on the signal low-passed and decimated by two.
+// Kernels are built once per (fmin, fmax, bins, fs) and kept for the life
+// of the process, like the window tables.
+#define AUDIO_CQT_Q 1            // filter quality scaling
+#define AUDIO_CQT_HOP 0.25       // atom hop, as a fraction of the shortest atom
+#define AUDIO_CQT_THRESH 0.0005  // spectral kernel magnitudes below this are dropped
+
+typedef struct audio_cqt_kernel {
+  double fmin, fmax, fs;
+  int bins;
+  int octaves;
+  long fft_len, fft_hop;
+  long atom_hop, first_center;
+  long atoms;      // atoms per frame and bin
+  long *start;     // per atom (bin * atoms + i): first spectral bin,
+  long *count;     // number of spectral bins,
+  double **coef;   // and count interleaved complex weights
+  struct audio_cqt_kernel *next;
+} audio_cqt_kernel_t;
+
+static audio_cqt_kernel_t *audio_cqt_kernels = NULL;
+static pthread_mutex_t audio_cqt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void audio_cqt_fill(audio_cqt_kernel_t *e)
+{
+  const double fmin = e->fmax / 2 * exp2(1. / e->bins); // lowest bin of the top octave
+  const double Q = AUDIO_CQT_Q / (exp2(1. / e->bins) - 1);
+  const long nk_max = lround(Q * e->fs / fmin);
+  const long nk_min = lround(Q * e->fs / (fmin * exp2((e->bins - 1.) / e->bins)));
+  long A = lround(nk_min * AUDIO_CQT_HOP);
+  if (A < 1)
+    A = 1;
+  long fc = (long)ceil(nk_max / 2.);
+  fc = A * ((fc + A - 1) / A);
+  long N = 1;
+  while (N < fc + (long)ceil(nk_max / 2.))
+    N *= 2;
+  const long W = (N - (long)ceil(nk_max / 2.) - fc) / A + 1;
+  const long noutput = N / 2 + 1;
+  e->fft_len = N;
+  e->atom_hop = A;
+  e->first_center = fc;
+  e->atoms = W;
+  e->fft_hop = W * A;
+  e->start = (long *)malloc(sizeof(long) * e->bins * W);
+  e->count = (long *)malloc(sizeof(long) * e->bins * W);
+  e->coef = (double **)malloc(sizeof(double *) * e->bins * W);
+
+  // spectrum of each bin's first atom; the others are shifts of it, which
+  // only rotate the phase, so they share its magnitudes and sparsity
+  fftw_complex *buf = (fftw_complex *)fftw_malloc(sizeof(fftw_complex) * N);
+  double *win = (double *)malloc(sizeof(double) * (nk_max + 1));
+  double *diag = (double *)calloc(noutput, sizeof(double));
+  pthread_mutex_lock(&audio_plan_lock);
+  fftw_plan plan = fftw_plan_dft_1d((int)N, buf, buf, FFTW_FORWARD, FFTW_ESTIMATE);
+  pthread_mutex_unlock(&audio_plan_lock);
+  int k;
+  long i, r;
+  for (k = 0; k < e->bins; k++) {
+    double fk = fmin * exp2((double)k / e->bins);
+    long nk = lround(Q * e->fs / fk);
+    long offset = fc - (nk + 1) / 2;
+    audio_window_fill(win, nk, 5);
+    memset(buf, 0, sizeof(fftw_complex) * N);
+    for (i = 0; i < nk; i++) {
+      double w = sqrt(fmax(0, win[i])) / nk;
+      buf[offset + i][0] = w * cos(2 * M_PI * fk * i / e->fs);
+      buf[offset + i][1] = w * sin(2 * M_PI * fk * i / e->fs);
+    }
+    fftw_execute_dft(plan, buf, buf);
+    long first = noutput, last = -1;
+    for (r = 0; r < noutput; r++) {
+      if (hypot(buf[r][0], buf[r][1]) > AUDIO_CQT_THRESH) {
+        if (first == noutput)
+          first = r;
+        last = r;
+      }
+    }
+    long count = last >= first ? last - first + 1 : 0;
+    for (i = 0; i < W; i++) {
+      long a = k * W + i;
+      e->start[a] = count ? first : 0;
+      e->count[a] = count;
+      e->coef[a] = (double *)malloc(sizeof(double) * 2 * (count ? count : 1));
+      for (r = 0; r < count; r++) {
+        long bin = first + r;
+        double re = buf[bin][0], im = buf[bin][1];
+        if (hypot(re, im) <= AUDIO_CQT_THRESH)
+          re = im = 0;
+        double phi = -2 * M_PI * (double)bin * (i * A) / N;
+        double sre = (re * cos(phi) - im * sin(phi)) / N;
+        double sim = (re * sin(phi) + im * cos(phi)) / N;
+        // stored conjugated: a coefficient is sum(coef * X)
+        e->coef[a][2 * r] = sre;
+        e->coef[a][2 * r + 1] = -sim;
+        diag[bin] += sre * sre + sim * sim;
+      }
+    }
+  }
+  pthread_mutex_lock(&audio_plan_lock);
+  fftw_destroy_plan(plan);
+  pthread_mutex_unlock(&audio_plan_lock);
+
+  // normalize so that the frames overlap-add to unit gain: average the
+  // kernel's energy between the peaks of the lowest and highest atoms,
+  // leaving out the edges of that range
+  long wx1 = 0, wx2 = 0, a;
+  double m1 = -1, m2 = -1;
+  const long alast = (long)e->bins * W - 1;
+  for (r = 0; r < e->count[0]; r++) {
+    double v = hypot(e->coef[0][2 * r], e->coef[0][2 * r + 1]);
+    if (v > m1) { m1 = v; wx1 = e->start[0] + r; }
+  }
+  for (r = 0; r < e->count[alast]; r++) {
+    double v = hypot(e->coef[alast][2 * r], e->coef[alast][2 * r + 1]);
+    if (v > m2) { m2 = v; wx2 = e->start[alast] + r; }
+  }
+  long lo = wx1 + (long)lround(1. / AUDIO_CQT_Q + 1);
+  long hi = wx2 - (long)lround(1. / AUDIO_CQT_Q + 2);
+  if (hi < lo) {
+    lo = wx1;
+    hi = wx2;
+  }
+  double mean = 0;
+  for (r = lo; r <= hi; r++)
+    mean += diag[r];
+  mean /= (hi - lo + 1);
+  double weight = mean > 0 ? sqrt((double)e->fft_hop / N / mean) : 1;
+  for (a = 0; a <= alast; a++)
+    for (r = 0; r < 2 * e->count[a]; r++)
+      e->coef[a][r] *= weight;
+
+  fftw_free(buf);
+  free(win);
+  free(diag);
+}
+
+static const audio_cqt_kernel_t *audio_cqt_kernel(double fmin, double fmax, int bins, double fs)
+{
+  if (bins < 1 || fs <= 0)
+    THError("[cqt] bins and sample_rate should be positive");
+  if (fmin <= 0 || fmax <= fmin || fmax > fs / 2)
+    THError("[cqt] frequency range should satisfy 0 < fmin < fmax <= sample_rate/2");
+  audio_cqt_kernel_t *e;
+  pthread_mutex_lock(&audio_cqt_lock);
+  for (e = audio_cqt_kernels; e; e = e->next)
+    if (e->fmin == fmin && e->fmax == fmax && e->bins == bins && e->fs == fs)
+      break;
+  if (e == NULL) {
+    e = (audio_cqt_kernel_t *)malloc(sizeof(audio_cqt_kernel_t));
+    e->fmin = fmin;
+    e->fmax = fmax;
+    e->bins = bins;
+    e->fs = fs;
+    e->octaves = (int)ceil(log2(fmax / fmin));
+    if (e->octaves < 1)
+      e->octaves = 1;
+    audio_cqt_fill(e);
+    e->next = audio_cqt_kernels;
+    audio_cqt_kernels = e;
+  }
+  pthread_mutex_unlock(&audio_cqt_lock);
+  return e;
+}
+
+// 6th order Butterworth low-pass at half the Nyquist frequency, as three
+// biquads {b0, b1, b2, a1, a2}; bilinear transform of the analog prototype
+#define AUDIO_CQT_LP_SECTIONS 3
+
+static void audio_cqt_lowpass(double sos[AUDIO_CQT_LP_SECTIONS][5])
+{
+  const int order = 2 * AUDIO_CQT_LP_SECTIONS;
+  const double wa = tan(M_PI * 0.5 / 2); // prewarped cutoff
+  int k;
+  for (k = 0; k < AUDIO_CQT_LP_SECTIONS; k++) {
+    double re = wa * cos(M_PI * (2 * k + order + 1) / (2 * order));
+    double a0 = 1 - 2 * re + wa * wa;
+    sos[k][0] = wa * wa / a0;
+    sos[k][1] = 2 * wa * wa / a0;
+    sos[k][2] = wa * wa / a0;
+    sos[k][3] = (2 * wa * wa - 2) / a0;
+    sos[k][4] = (1 + 2 * re + wa * wa) / a0;
+  }
+}
+
+// one biquad over n samples x[0], x[step], ..., from rest
+static void audio_biquad(double *x, long n, long step, const double *c)
+{
+  double z1 = 0, z2 = 0;
+  long i;
+  for (i = 0; i < n; i++, x += step) {
+    double in = *x, out = c[0] * in + z1;
+    z1 = c[1] * in - c[3] * out + z2;
+    z2 = c[2] * in - c[4] * out;
+    *x = out;
+  }
+}
+
+// zero-phase low-pass (forward then backward) and keep every other sample;
+// returns the new length
+static long audio_cqt_decimate(double *x, long n, double sos[AUDIO_CQT_LP_SECTIONS][5])
+{
+  int k;
+  long i;
+  for (k = 0; k < AUDIO_CQT_LP_SECTIONS; k++)
+    audio_biquad(x, n, 1, sos[k]);
+  for (k = 0; k < AUDIO_CQT_LP_SECTIONS; k++)
+    audio_biquad(x + n - 1, n, -1, sos[k]);
+  for (i = 0; i < n / 2; i++)
+    x[i] = x[2 * i];
+  return n / 2;
+}
+// End of constant-Q kernels section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Threading.
+// Transforms split their frames across audio_num_threads OpenMP threads.
+// Every frame is computed exactly as in the serial loop, so the output does
+// not depend on the thread count.
+static int audio_num_threads = 0; // 0: OpenMP default
+
+// below this many input samples per call, threading costs more than it saves
+#define AUDIO_PARALLEL_MIN (1 << 15)
+
+static int audio_threads(void)
+{
+#ifdef _OPENMP
+  return audio_num_threads > 0 ? audio_num_threads : omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// arguments [number of threads, 0 for the OpenMP default]
+static int audio_setNumThreads(lua_State *L)
+{
+  int n = luaL_checkint(L, 1);
+  if (n < 0)
+    return luaL_error(L, "number of threads should be >= 0");
+  audio_num_threads = n;
+  return 0;
+}
+
+static int audio_getNumThreads(lua_State *L)
+{
+  lua_pushnumber(L, audio_threads());
+  return 1;
+}
+
+static const struct luaL_Reg audio_threads__ [] = {
+  {"setNumThreads", audio_setNumThreads},
+  {"getNumThreads", audio_getNumThreads},
+  {NULL, NULL}
+};
+
+// Per-thread scratch. The frame loops take their frame and spectrum buffers
+// from here instead of allocating them on every call. A buffer only grows,
+// and OpenMP keeps its worker threads, so once a transform size has been
+// seen repeated calls allocate nothing. Buffers are fftw_malloc'd, with the
+// alignment the plans were made for, and live as long as their thread.
+#if defined(_MSC_VER)
+#define AUDIO_THREAD_LOCAL __declspec(thread)
+#else
+#define AUDIO_THREAD_LOCAL __thread
+#endif
+
+enum {
+  AUDIO_SCRATCH_FRAMES,
+  AUDIO_SCRATCH_SPECTRA,
+  AUDIO_SCRATCH_SLOTS
+};
+
+typedef struct {
+  void *data;
+  size_t size;
+} audio_scratch_t;
+
+static AUDIO_THREAD_LOCAL audio_scratch_t audio_scratch_[AUDIO_SCRATCH_SLOTS];
+
+// at least size bytes for slot; the contents are not kept across calls
+static void *audio_scratch(int slot, size_t size)
+{
+  audio_scratch_t *s = &audio_scratch_[slot];
+  if (s->size < size) {
+    fftw_free(s->data);
+    s->data = fftw_malloc(size);
+    s->size = size;
+  }
+  return s->data;
+}
+// End of threading section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// STFT options, passed from lua as an optional table
+
+// Memory layout of a complex STFT tensor. The default is the historical
+// one: [frames x bins x 2], highest frequency bin first.
+typedef struct {
+  int natural;    // lowest frequency bin first
+  int bin_major;  // bins before frames
+  int split;      // [2 x ...] real and imaginary planes, not trailing pairs
+} audio_layout_t;
+
+typedef struct {
+  int batched;  // transform blocks of frames with one many-plan execution
+  int batch;    // 2D input is batch x samples rather than samples x channels
+  audio_layout_t layout;
+} audio_stft_opts_t;
+
+// look up opts[field], one of two names; returns 1 for the second one
+static int audio_check_choice(lua_State *L, int idx, const char *field,
+                              const char *first, const char *second)
+{
+  int choice = 0;
+  lua_getfield(L, idx, field);
+  if (!lua_isnil(L, -1)) {
+    const char *name = lua_tostring(L, -1);
+    if (name && strcmp(name, second) == 0)
+      choice = 1;
+    else if (name == NULL || strcmp(name, first) != 0)
+      luaL_error(L, "option %s should be '%s' or '%s'", field, first, second);
+  }
+  lua_pop(L, 1);
+  return choice;
+}
+
+static void audio_check_stft_opts(lua_State *L, int idx, audio_stft_opts_t *opts)
+{
+  memset(opts, 0, sizeof(audio_stft_opts_t));
+  if (lua_isnoneornil(L, idx))
+    return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, "batched");
+  opts->batched = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "batch");
+  opts->batch = lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  opts->layout.natural = audio_check_choice(L, idx, "order", "reversed", "natural");
+  opts->layout.bin_major = audio_check_choice(L, idx, "major", "frame", "bin");
+  opts->layout.split = audio_check_choice(L, idx, "complex", "interleaved", "split");
+}
+
+// index of the frame and bin dimensions among the last three of a tensor
+// in layout l; the remaining one holds the real and imaginary parts
+static int audio_layout_frame_dim(const audio_layout_t *l)
+{
+  return l->split ? (l->bin_major ? 2 : 1) : (l->bin_major ? 1 : 0);
+}
+
+static int audio_layout_bin_dim(const audio_layout_t *l)
+{
+  return l->split ? (l->bin_major ? 1 : 2) : (l->bin_major ? 0 : 1);
+}
+
+// Strides of a contiguous STFT tensor in layout l, for signal, frame, bin
+// and real/imaginary part; sizes gets the last three dimensions.
+typedef struct {
+  long signal, frame, bin, part;
+} audio_layout_strides_t;
+
+static void audio_layout_geometry(const audio_layout_t *l, long nframes, long nbins,
+                                  long sizes[3], audio_layout_strides_t *st)
+{
+  const int frame_dim = audio_layout_frame_dim(l), bin_dim = audio_layout_bin_dim(l);
+  const int part_dim = 3 - frame_dim - bin_dim;
+  sizes[frame_dim] = nframes;
+  sizes[bin_dim] = nbins;
+  sizes[part_dim] = 2;
+  const long strides[3] = {sizes[1] * sizes[2], sizes[2], 1};
+  st->signal = sizes[0] * sizes[1] * sizes[2];
+  st->frame = strides[frame_dim];
+  st->bin = strides[bin_dim];
+  st->part = strides[part_dim];
+}
+
+// spectrogram modes, matching audio.spectrogram_modes in init.lua
+enum {
+  AUDIO_SPEC_MAGNITUDE = 1, // |X|
+  AUDIO_SPEC_POWER,         // |X|^2
+  AUDIO_SPEC_LOG,           // 10 * ln(|X|^2 + 0.01), the historical default
+  AUDIO_SPEC_DB             // 10 * log10(max(|X|^2, 1e-10))
+};
+
+static double audio_spec_scale(double p, int mode)
+{
+  switch (mode) {
+  case AUDIO_SPEC_MAGNITUDE: return sqrt(p);
+  case AUDIO_SPEC_LOG: return 10 * log(p + 0.01);
+  case AUDIO_SPEC_DB: return 10 * log10(p > 1e-10 ? p : 1e-10);
+  }
+  return p;
+}
+
+// mel spectrogram and MFCC options, passed from lua in the same table as
+// the STFT options
+typedef struct {
+  int n_mels;
+  int n_mfcc;
+  double fmin, fmax; // fmax < 0: sample_rate / 2
+} audio_mel_opts_t;
+
+static void audio_check_mel_opts(lua_State *L, int idx, audio_mel_opts_t *opts)
+{
+  opts->n_mels = 40;
+  opts->n_mfcc = 13;
+  opts->fmin = 0;
+  opts->fmax = -1;
+  if (lua_isnoneornil(L, idx))
+    return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, "n_mels");
+  if (lua_isnumber(L, -1))
+    opts->n_mels = (int)lua_tonumber(L, -1);
+  lua_getfield(L, idx, "n_mfcc");
+  if (lua_isnumber(L, -1))
+    opts->n_mfcc = (int)lua_tonumber(L, -1);
+  lua_getfield(L, idx, "fmin");
+  if (lua_isnumber(L, -1))
+    opts->fmin = lua_tonumber(L, -1);
+  lua_getfield(L, idx, "fmax");
+  if (lua_isnumber(L, -1))
+    opts->fmax = lua_tonumber(L, -1);
+  lua_pop(L, 4);
+}
+
+// Frames per batched execution: enough to fill about AUDIO_BATCH_BYTES of
+// input, rounded to a power of two (and no more than the signal needs) so
+// that only a handful of many-plans ever get created per window size.
+#define AUDIO_BATCH_BYTES (1 << 20)
+
+static long audio_batch_frames(long window_size, long nwindows, size_t elsize)
+{
+  long cap = AUDIO_BATCH_BYTES / (window_size * (long)elsize);
+  long howmany = 1;
+  while (howmany * 2 <= cap && howmany < nwindows)
+    howmany *= 2;
+  return howmany;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Streaming STFT handle (audio.STFTStream).
+// Samples are kept in a mirrored ring of window_size samples: each sample
+// is written at pos and pos + window_size, so the last window_size samples
+// are always one contiguous run and a frame is read without wrapping.
+// Positions are absolute sample counts since the start of the stream. The
+// FFT buffers are allocated once, so pushing a chunk allocates nothing
+// beyond growing the caller's output tensor.
+#define AUDIO_STFT_STREAM "audio.stft_stream"
+
+typedef struct {
+  long window_size, hop;
+  const audio_window_entry_t *window;
+  double *ring;       // 2 * window_size samples
+  long total;         // samples pushed
+  long head;          // start of the next frame
+  long covered;       // end of the last frame emitted
+  void *buffer;       // window_size reals, in the precision of the caller
+  void *fbuffer;      // window_size/2+1 complex
+} audio_stft_stream_t;
+
+static audio_stft_stream_t *audio_checkstftstream(lua_State *L, int idx)
+{
+  return (audio_stft_stream_t *)luaL_checkudata(L, idx, AUDIO_STFT_STREAM);
+}
+
+// forget any buffered samples and start a new stream
+static void audio_stft_stream_clear(audio_stft_stream_t *s)
+{
+  s->total = 0;
+  s->head = 0;
+  s->covered = 0;
+}
+
+// arguments [window-size, window-type, hop-size/stride]
+static int audio_stft_stream_open(lua_State *L)
+{
+  long window_size = luaL_checklong(L, 1);
+  int window_type = luaL_checkint(L, 2);
+  long hop = luaL_checklong(L, 3);
+  if (window_size <= 0 || hop <= 0)
+    luaL_error(L, "[stft_stream_open] window_size and hop should be positive");
+  audio_stft_stream_t *s = (audio_stft_stream_t *)lua_newuserdata(L, sizeof(audio_stft_stream_t));
+  s->ring = NULL;
+  s->buffer = NULL;
+  s->fbuffer = NULL;
+  luaL_getmetatable(L, AUDIO_STFT_STREAM);
+  lua_setmetatable(L, -2);
+  s->window_size = window_size;
+  s->hop = hop;
+  s->window = audio_window(window_type, window_size);
+  s->ring = (double *)calloc(2 * window_size, sizeof(double));
+  // sized for double precision, so the single precision path fits too
+  s->buffer = fftw_malloc(sizeof(double) * window_size);
+  s->fbuffer = fftw_malloc(sizeof(fftw_complex) * (window_size / 2 + 1));
+  if (s->ring == NULL || s->buffer == NULL || s->fbuffer == NULL)
+    luaL_error(L, "[stft_stream_open] Failure to allocate buffers");
+  audio_stft_stream_clear(s);
+  return 1;
+}
+
+static int audio_stft_stream_gc(lua_State *L)
+{
+  audio_stft_stream_t *s = audio_checkstftstream(L, 1);
+  free(s->ring);
+  fftw_free(s->buffer);
+  fftw_free(s->fbuffer);
+  s->ring = NULL;
+  s->buffer = NULL;
+  s->fbuffer = NULL;
+  return 0;
+}
+
+static int audio_stft_stream_reset(lua_State *L)
+{
+  audio_stft_stream_clear(audio_checkstftstream(L, 1));
+  return 0;
+}
+
+// samples buffered and not yet covered by an emitted frame
+static int audio_stft_stream_pending(lua_State *L)
+{
+  audio_stft_stream_t *s = audio_checkstftstream(L, 1);
+  long from = s->covered > s->head ? s->covered : s->head;
+  lua_pushnumber(L, (double)(s->total > from ? s->total - from : 0));
+  return 1;
+}
+
+static const luaL_Reg audio_stft_stream__[] =
+{
+  {"close", audio_stft_stream_gc},
+  {"reset", audio_stft_stream_reset},
+  {"pending", audio_stft_stream_pending},
+  {NULL, NULL}
+};
+// End of streaming STFT section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Streaming inverse STFT handle (audio.ISTFTStream).
+// Each pushed frame is added into a window_size accumulator that starts at
+// the first unfinished sample. No later frame reaches the first hop
+// samples, so they are normalized and handed out, and the accumulator
+// shifts by one hop.
+#define AUDIO_ISTFT_STREAM "audio.istft_stream"
+
+typedef struct {
+  long window_size, hop;
+  const audio_ola_entry_t *ola;
+  double *acc;        // window_size samples from the first unfinished one
+  long nframes;       // frames pushed
+  void *buffer;       // window_size reals, in the precision of the caller
+  void *cbuffer;      // window_size/2+1 complex
+} audio_istft_stream_t;
+
+static audio_istft_stream_t *audio_checkistftstream(lua_State *L, int idx)
+{
+  return (audio_istft_stream_t *)luaL_checkudata(L, idx, AUDIO_ISTFT_STREAM);
+}
+
+static void audio_istft_stream_clear(audio_istft_stream_t *s)
+{
+  memset(s->acc, 0, sizeof(double) * s->window_size);
+  s->nframes = 0;
+}
+
+// arguments [window-size, window-type, hop-size/stride]
+static int audio_istft_stream_open(lua_State *L)
+{
+  long window_size = luaL_checklong(L, 1);
+  int window_type = luaL_checkint(L, 2);
+  long hop = luaL_checklong(L, 3);
+  if (window_size <= 0 || hop <= 0 || hop > window_size)
+    luaL_error(L, "[istft_stream_open] window_size should be positive and hop between 1 and window_size");
+  audio_istft_stream_t *s = (audio_istft_stream_t *)lua_newuserdata(L, sizeof(audio_istft_stream_t));
+  s->acc = NULL;
+  s->buffer = NULL;
+  s->cbuffer = NULL;
+  luaL_getmetatable(L, AUDIO_ISTFT_STREAM);
+  lua_setmetatable(L, -2);
+  s->window_size = window_size;
+  s->hop = hop;
+  s->ola = audio_ola(window_type, window_size, hop);
+  s->acc = (double *)malloc(sizeof(double) * window_size);
+  s->buffer = fftw_malloc(sizeof(double) * window_size);
+  s->cbuffer = fftw_malloc(sizeof(fftw_complex) * (window_size / 2 + 1));
+  if (s->acc == NULL || s->buffer == NULL || s->cbuffer == NULL)
+    luaL_error(L, "[istft_stream_open] Failure to allocate buffers");
+  audio_istft_stream_clear(s);
+  return 1;
+}
+
+static int audio_istft_stream_gc(lua_State *L)
+{
+  audio_istft_stream_t *s = audio_checkistftstream(L, 1);
+  free(s->acc);
+  fftw_free(s->buffer);
+  fftw_free(s->cbuffer);
+  s->acc = NULL;
+  s->buffer = NULL;
+  s->cbuffer = NULL;
+  return 0;
+}
+
+static int audio_istft_stream_reset(lua_State *L)
+{
+  audio_istft_stream_clear(audio_checkistftstream(L, 1));
+  return 0;
+}
+
+static const luaL_Reg audio_istft_stream__[] =
+{
+  {"close", audio_istft_stream_gc},
+  {"reset", audio_istft_stream_reset},
+  {NULL, NULL}
+};
+// End of streaming inverse STFT section
+////////////////////////////////////////////////////////////////////////////
+
+// stream constructors, set on the audio table
+static const struct luaL_Reg audio_stream__ [] = {
+  {"stft_stream_open", audio_stft_stream_open},
+  {"istft_stream_open", audio_istft_stream_open},
+  {NULL, NULL}
+};
+
+// input samples per channel pushed through the resampler at a time
+#define AUDIO_RESAMPLE_BLOCK 4096
+
+#include "generic/resample.c"
+#include "THGenerateAllTypes.h"
+
 #include "generic/audio.c"
 #include "THGenerateAllTypes.h"
 
@@ -40,9 +1133,28 @@ DLL_EXPORT int luaopen_libaudio(lua_State *L)
   audio_FloatMain_init(L);
   audio_DoubleMain_init(L);
 
+  luaL_newmetatable(L, AUDIO_STFT_STREAM);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, audio_stft_stream_gc);
+  lua_setfield(L, -2, "__gc");
+  luaT_setfuncs(L, audio_stft_stream__, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, AUDIO_ISTFT_STREAM);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, audio_istft_stream_gc);
+  lua_setfield(L, -2, "__gc");
+  luaT_setfuncs(L, audio_istft_stream__, 0);
+  lua_pop(L, 1);
+
   lua_newtable(L);
   lua_pushvalue(L, -1);
   lua_setglobal(L, "audio");
+  luaT_setfuncs(L, audio_fftw__, 0);
+  luaT_setfuncs(L, audio_threads__, 0);
+  luaT_setfuncs(L, audio_stream__, 0);
 
   lua_newtable(L);
   luaT_setfuncs(L, audio_DoubleMain__, 0);
@@ -0,0 +1,249 @@
+----------------------------------------------------------------------
+-- benchmark: throughput of the decode, encode and transform hot paths,
+-- reported as JSON so that runs on different commits can be compared.
+--
+-- Every case runs once to warm up (plans, windows, kernels and scratch
+-- buffers are built on first use) and then opts.repeats times; the median
+-- and the fastest of the timed runs are reported. A case that fails, for
+-- instance a format libsox was built without, is reported with its error
+-- instead of stopping the run.
+----------------------------------------------------------------------
+
+local voice_path = sys.concat(sys.fpath(), 'voice.mp3')
+
+local defaults = {
+   formats = {'wav', 'flac', 'ogg', 'mp3'},
+   seconds = 30,                     -- length of the synthetic signal
+   rate = 16000,
+   channels = 2,
+   window_sizes = {256, 512, 1024, 2048},
+   strides = {0.5, 0.25},            -- fractions of the window size
+   types = {'torch.FloatTensor', 'torch.DoubleTensor'},
+   threads = {1, 0},                 -- 0: the OpenMP default
+   repeats = 5,
+   voice = true,                     -- also decode voice.mp3
+   output = nil,                     -- file to write the JSON to, default: stdout
+   label = nil,                      -- free text kept in the report, e.g. a commit hash
+}
+
+----------------------------------------------------------------------
+-- JSON, enough for the report: tables with only integer keys 1..n are
+-- arrays, other tables objects with sorted keys
+local function json(v, out)
+   local t = type(v)
+   if t == 'table' then
+      if #v > 0 or next(v) == nil then
+         table.insert(out, '[')
+         for i = 1, #v do
+            if i > 1 then table.insert(out, ',') end
+            json(v[i], out)
+         end
+         table.insert(out, ']')
+      else
+         local keys = {}
+         for k in pairs(v) do table.insert(keys, tostring(k)) end
+         table.sort(keys)
+         table.insert(out, '{')
+         for i, k in ipairs(keys) do
+            if i > 1 then table.insert(out, ',') end
+            json(k, out)
+            table.insert(out, ':')
+            json(v[k], out)
+         end
+         table.insert(out, '}')
+      end
+   elseif t == 'number' then
+      if v ~= v or v == math.huge or v == -math.huge then
+         table.insert(out, 'null')
+      elseif v == math.floor(v) and math.abs(v) < 2^53 then
+         table.insert(out, string.format('%d', v))
+      else
+         table.insert(out, string.format('%.6g', v))
+      end
+   elseif t == 'boolean' then
+      table.insert(out, tostring(v))
+   elseif t == 'nil' then
+      table.insert(out, 'null')
+   else
+      table.insert(out, '"' .. tostring(v):gsub('[%c"\\]', function(c)
+         return string.format('\\u%04x', c:byte())
+      end) .. '"')
+   end
+   return out
+end
+
+----------------------------------------------------------------------
+-- seconds taken by fn: median and fastest of repeats runs, after a warmup
+local function timeit(fn, repeats)
+   fn()
+   local times = {}
+   local timer = torch.Timer()
+   for i = 1, repeats do
+      collectgarbage()
+      timer:reset()
+      fn()
+      times[i] = timer:time().real
+   end
+   table.sort(times)
+   local n = #times
+   local median = n % 2 == 1 and times[(n + 1) / 2]
+      or (times[n / 2] + times[n / 2 + 1]) / 2
+   return median, times[1]
+end
+
+-- run a case and add its entry to results: fields describe the case,
+-- work(seconds) returns the throughput fields
+local function case(results, repeats, fields, fn, work)
+   local ok, median, fastest = pcall(timeit, fn, repeats)
+   if ok then
+      fields.seconds = median
+      fields.fastest = fastest
+      for k, v in pairs(work(median)) do fields[k] = v end
+   else
+      fields.error = tostring(median)
+   end
+   table.insert(results, fields)
+   io.stderr:write(string.format('%-12s %-6s %-18s %s\n', fields.op, fields.format or '',
+                                 fields.type or '', ok and string.format('%.4fs', median)
+                                    or fields.error))
+end
+
+-- a few tones sweeping over each other, with a little noise, in the full
+-- sample range libsox works in
+local function signal(seconds, rate, channels)
+   local n = math.floor(seconds * rate)
+   local t = torch.range(0, n - 1):div(rate)
+   local x = torch.DoubleTensor(n, channels)
+   local gen = torch.Generator()
+   torch.manualSeed(gen, 1234)
+   for c = 1, channels do
+      local f = 220 * c
+      local sweep = t:clone():pow(2):mul(math.pi * 50 * c):add(t:clone():mul(2 * math.pi * f))
+      x:select(2, c):copy(sweep:sin():mul(0.5))
+      x:select(2, c):add(torch.randn(gen, n):mul(0.01))
+   end
+   return x:mul(2^30)
+end
+
+local function frames(n, window_size, stride)
+   return n < window_size and 0 or math.floor((n - window_size) / stride) + 1
+end
+
+----------------------------------------------------------------------
+-- io cases: save, load, compress and decompress in each format
+local function bench_io(results, opts, x)
+   local nsamples = x:size(1) * x:size(2)
+   for _, format in ipairs(opts.formats) do
+      local file = os.tmpname() .. '.' .. format
+      local bytes = 0
+      local per_second = function(seconds)
+         return {samples_per_s = nsamples / seconds, mb_per_s = bytes / seconds / 1e6,
+                 bytes = bytes}
+      end
+      case(results, opts.repeats, {op = 'save', format = format},
+           function() audio.save(file, x, opts.rate) end,
+           function(s)
+              local f = io.open(file, 'rb')
+              bytes = f:seek('end')
+              f:close()
+              return per_second(s)
+           end)
+      case(results, opts.repeats, {op = 'load', format = format},
+           function() audio.load(file) end, per_second)
+      case(results, opts.repeats, {op = 'load', format = format, type = 'torch.ShortTensor'},
+           function() audio.load(file, {type = 'torch.ShortTensor'}) end, per_second)
+      os.remove(file)
+
+      local blob
+      case(results, opts.repeats, {op = 'compress', format = format},
+           function() blob = audio.compress(x, opts.rate, format) end,
+           function(s)
+              bytes = blob:nElement()
+              return per_second(s)
+           end)
+      if blob then
+         case(results, opts.repeats, {op = 'decompress', format = format},
+              function() audio.decompress(blob, format) end, per_second)
+      end
+   end
+   if opts.voice and paths.filep(voice_path) then
+      local voice = audio.load(voice_path)
+      local nvoice = voice:size(1) * voice:size(2)
+      local f = io.open(voice_path, 'rb')
+      local size = f:seek('end')
+      f:close()
+      case(results, opts.repeats, {op = 'load', format = 'mp3', file = 'voice.mp3'},
+           function() audio.load(voice_path) end,
+           function(s)
+              return {samples_per_s = nvoice / s, mb_per_s = size / s / 1e6, bytes = size}
+           end)
+   end
+end
+
+----------------------------------------------------------------------
+-- transform cases: stft and spectrogram over every window size, stride,
+-- type and thread count
+local function bench_transforms(results, opts, x)
+   local threads = audio.getNumThreads()
+   for _, tname in ipairs(opts.types) do
+      local input = x:select(2, 1):clone():div(2^31):type(tname)
+      local n = input:size(1)
+      for _, nthreads in ipairs(opts.threads) do
+         audio.setNumThreads(nthreads)
+         local used = audio.getNumThreads()
+         for _, window_size in ipairs(opts.window_sizes) do
+            for _, fraction in ipairs(opts.strides) do
+               local stride = math.max(1, math.floor(window_size * fraction))
+               local nframes = frames(n, window_size, stride)
+               local out = input.new()
+               local per_second = function(seconds)
+                  return {frames = nframes, frames_per_s = nframes / seconds,
+                          samples_per_s = n / seconds}
+               end
+               for _, op in ipairs({'stft', 'spectrogram'}) do
+                  case(results, opts.repeats,
+                       {op = op, type = tname, window_size = window_size, stride = stride,
+                        threads = used},
+                       function()
+                          audio[op](input, window_size, 'hann', stride, {out = out})
+                       end, per_second)
+               end
+            end
+         end
+      end
+   end
+   audio.setNumThreads(threads)
+end
+
+----------------------------------------------------------------------
+local function benchmark(opts)
+   local o = {}
+   for k, v in pairs(defaults) do o[k] = v end
+   for k, v in pairs(opts or {}) do o[k] = v end
+   opts = o
+
+   local x = signal(opts.seconds, opts.rate, opts.channels)
+   local results = {}
+   if xlua.require 'libsox' then
+      bench_io(results, opts, x)
+   end
+   bench_transforms(results, opts, x)
+
+   local report = {
+      label = opts.label,
+      date = os.date('!%Y-%m-%dT%H:%M:%SZ'),
+      config = {seconds = opts.seconds, rate = opts.rate, channels = opts.channels,
+                repeats = opts.repeats, samples = x:size(1)},
+      results = results,
+   }
+   local text = table.concat(json(report, {}))
+   if opts.output then
+      local f = assert(io.open(opts.output, 'w'))
+      f:write(text, '\n')
+      f:close()
+   else
+      print(text)
+   end
+   return report
+end
+rawset(audio, 'benchmark', benchmark)
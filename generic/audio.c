@@ -38,85 +38,662 @@
 /* ---------------------------------------------------------------------- */
 
 
-// write audio.toMono() which converts a multi-channel audio to single channel
-
-#ifndef M_PI
-#define M_PI 3.14159265358979323846264338327950288
+// Float tensors are transformed with single precision FFTW (fftwf_*) end to
+// end; every other type goes through double precision.
+#if defined(TH_REAL_IS_FLOAT)
+#define fft_real float
+#define fftw_(NAME) TH_CONCAT_2(fftwf_, NAME)
+#define AUDIO_FFT_SINGLE 1
+#define audio_window_coef(e) ((e)->coeff)
+#else
+#define fft_real double
+#define fftw_(NAME) TH_CONCAT_2(fftw_, NAME)
+#define AUDIO_FFT_SINGLE 0
+#define audio_window_coef(e) ((e)->coef)
 #endif
 
-// Apply an edge-smoothing function to make the signal periodic. 
-// Different window types are provided
-static inline void audio_(apply_window)(double *input, 
-                                       long window_size, int window_type) {
-  long i, m = window_size -1;
-    switch (window_type) {
-    case 1: // Rectangular Window, do nothing
-      break;
-    case 2: // Hamming Window
-      for (i = 0; i < window_size; ++i) 
-        input[i] *= .53836 - .46164 * cos(2 * M_PI * i / m);
-      break;
-    case 3: // Hann Window
-      for (i = 0; i < window_size; ++i) 
-        input[i] *= .5 - .5 * cos(2 * M_PI * i / m);
-      break;
-    case 4: // Bartlett Window
-      for (i = 0; i < window_size; ++i) 
-        input[i] *= 2. / m * (m / 2. - fabs(i - m / 2.));
-      break;
-    default:
-      THError("[stft_generic] Unknown window_type");
-      break;
+////////////////////////////////////////////////////////////////////////////
+// plan makers for the cache in audio.c; called with audio_plan_lock held.
+// measuring planners scribble over the arrays, so plan on scratch ones.
+static void *audio_(make_plan)(const audio_plan_key_t *key)
+{
+  int n = (int)key->n;
+  int noutput = n / 2 + 1;
+  int howmany = (int)key->howmany;
+  fft_real *in = (fft_real *)fftw_(malloc)(sizeof(fft_real) * n * howmany);
+  fftw_(complex) *out = (fftw_(complex) *)fftw_(malloc)(sizeof(fftw_(complex)) * noutput * howmany);
+  fftw_(plan) plan = NULL;
+  switch (key->kind) {
+  case AUDIO_PLAN_R2C:
+    plan = fftw_(plan_dft_r2c_1d)(n, in, out, key->flags);
+    break;
+  case AUDIO_PLAN_R2C_MANY:
+    plan = fftw_(plan_many_dft_r2c)(1, &n, howmany, in, NULL, 1, n,
+                                    out, NULL, 1, noutput, key->flags);
+    break;
+  case AUDIO_PLAN_DCT2:
+    plan = fftw_(plan_r2r_1d)(n, in, (fft_real *)out, FFTW_REDFT10, key->flags);
+    break;
+  case AUDIO_PLAN_C2R:
+    plan = fftw_(plan_dft_c2r_1d)(n, out, in, key->flags);
+    break;
+  }
+  fftw_(free)(in);
+  fftw_(free)(out);
+  return plan;
+}
+
+// real-to-complex transform of size n, n/2+1 complex outputs
+static fftw_(plan) audio_(plan_r2c)(long n)
+{
+  audio_plan_key_t key = {AUDIO_PLAN_R2C, AUDIO_FFT_SINGLE, n, 1, audio_planner_flags};
+  return (fftw_(plan))audio_plan_get(&key, audio_(make_plan));
+}
+
+// howmany real-to-complex transforms of size n in one execution. Inputs are
+// rows of a contiguous howmany x n matrix, outputs rows of a howmany x (n/2+1)
+// complex matrix.
+static fftw_(plan) audio_(plan_r2c_many)(long n, long howmany)
+{
+  audio_plan_key_t key = {AUDIO_PLAN_R2C_MANY, AUDIO_FFT_SINGLE, n, howmany, audio_planner_flags};
+  return (fftw_(plan))audio_plan_get(&key, audio_(make_plan));
+}
+
+// complex-to-real inverse transform of size n from n/2+1 complex inputs,
+// unnormalized; it overwrites its input
+static fftw_(plan) audio_(plan_c2r)(long n)
+{
+  audio_plan_key_t key = {AUDIO_PLAN_C2R, AUDIO_FFT_SINGLE, n, 1, audio_planner_flags};
+  return (fftw_(plan))audio_plan_get(&key, audio_(make_plan));
+}
+
+// unnormalized DCT-II of size n (FFTW_REDFT10)
+static fftw_(plan) audio_(plan_dct2)(long n)
+{
+  audio_plan_key_t key = {AUDIO_PLAN_DCT2, AUDIO_FFT_SINGLE, n, 1, audio_planner_flags};
+  return (fftw_(plan))audio_plan_get(&key, audio_(make_plan));
+}
+
+// Gather one frame of n samples (input stride istride), convert to fft_real and
+// apply the window in a single pass. The contiguous case is a plain
+// multiply loop that the compiler vectorizes.
+static inline void audio_(frame)(const real *input, long istride,
+                                 const fft_real *window, fft_real *out, long n)
+{
+  long k;
+  if (istride == 1) {
+    for (k = 0; k < n; k++)
+      out[k] = (fft_real)input[k] * window[k];
+  } else {
+    for (k = 0; k < n; k++)
+      out[k] = (fft_real)input[k * istride] * window[k];
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Framing shared by every frame-wise transform (stft, spectrogram, ...).
+// The input is 1D, [samples x channels], or [batch x samples] when batch is
+// set; each channel (or batch row) is one signal. frames_run windows and
+// transforms every frame of every signal and hands each spectrum straight
+// from the FFT buffer to a sink, which writes it to the caller's output.
+typedef struct {
+  real *input;
+  long length, istride;   // samples per signal, and their stride
+  long nsignals, sstride; // number of signals, and the stride between them
+  long window_size, stride;
+  long nwindows, noutput;
+  const fft_real *window;
+  // when set, spectra are transformed straight into direct +
+  // (signal * nwindows + frame) * noutput whenever the alignment allows,
+  // and the sink is not called for them
+  fftw_(complex) *direct;
+} audio_(frames_t);
+
+// called once per frame, possibly from several threads at once
+typedef void (*audio_(sink_t))(const fftw_(complex) *spectrum, long signal,
+                               long frame, void *ctx);
+
+static void audio_(frames_init)(audio_(frames_t) *fr, THTensor *input,
+                                long window_size, int window_type,
+                                long stride, int batch)
+{
+  const int ndim = THTensor_(nDimension)(input);
+  if (ndim < 1 || ndim > 2)
+    THError("[stft_generic] input should be 1D or 2D");
+  fr->nsignals = 1;
+  fr->sstride = 0;
+  if (batch) {
+    if (ndim != 2)
+      THError("[stft_generic] batch input should be batch x samples");
+    fr->nsignals = input->size[0];
+    fr->sstride = input->stride[0];
+    fr->length = input->size[1];
+    fr->istride = input->stride[1];
+  } else {
+    fr->length = input->size[0];
+    fr->istride = input->stride[0];
+    if (ndim > 1) {
+      fr->nsignals = input->size[1];
+      fr->sstride = input->stride[1];
     }
+  }
+  if (window_size <= 0 || stride <= 0)
+    THError("[stft_generic] window_size and stride should be positive");
+  if (fr->length < window_size)
+    THError("[stft_generic] input is shorter than window_size");
+  fr->input = THTensor_(data)(input);
+  fr->window_size = window_size;
+  fr->stride = stride;
+  fr->nwindows = ((fr->length - window_size) / stride) + 1;
+  fr->noutput = window_size / 2 + 1;
+  fr->window = audio_window_coef(audio_window(window_type, window_size));
+  fr->direct = NULL;
+}
+
+// new-array execution needs the same alignment the plan was made with
+static int audio_(direct_ok)(const fftw_(complex) *out)
+{
+  return fftw_(alignment_of)((fft_real *)out) == 0;
+}
+
+static void audio_(frames_run)(const audio_(frames_t) *fr, int batched,
+                               audio_(sink_t) sink, void *ctx)
+{
+  const long window_size = fr->window_size, stride = fr->stride;
+  const long nwindows = fr->nwindows, noutput = fr->noutput;
+  const long nsignals = fr->nsignals, istride = fr->istride;
+  const int nthreads = audio_threads();
+  const int parallel = nthreads > 1
+    && nsignals * nwindows * window_size >= AUDIO_PARALLEL_MIN;
+
+  if (batched) {
+    // frame a block of windows into one matrix and transform it with a
+    // single many-plan execution; the last block of a signal is zero-padded
+    const long howmany = audio_batch_frames(window_size, nwindows, sizeof(fft_real));
+    const long nblocks = (nwindows + howmany - 1) / howmany;
+    fftw_(plan) plan = audio_(plan_r2c_many)(window_size, howmany);
+#pragma omp parallel num_threads(nthreads) if(parallel && nsignals * nblocks > 1)
+    {
+      fft_real *frames = (fft_real*)audio_scratch(AUDIO_SCRATCH_FRAMES,
+                                                  sizeof(fft_real) * window_size * howmany);
+      fftw_(complex) *spectra = (fftw_(complex)*)audio_scratch(AUDIO_SCRATCH_SPECTRA,
+                                                              sizeof(fftw_(complex)) * noutput * howmany);
+      long job, f;
+#pragma omp for schedule(static)
+      for (job = 0; job < nsignals * nblocks; job++) {
+        long signal = job / nblocks;
+        long first = (job % nblocks) * howmany;
+        long nframes = nwindows - first < howmany ? nwindows - first : howmany;
+        const real *in = fr->input + signal * fr->sstride;
+        for (f = 0; f < nframes; f++)
+          audio_(frame)(in + (first + f) * stride * istride, istride, fr->window,
+                        frames + f * window_size, window_size);
+        if (nframes < howmany)
+          memset(frames + nframes * window_size, 0,
+                 sizeof(fft_real) * window_size * (howmany - nframes));
+        fftw_(complex) *out = fr->direct ? fr->direct + (signal * nwindows + first) * noutput : NULL;
+        if (out && nframes == howmany && audio_(direct_ok)(out)) {
+          fftw_(execute_dft_r2c)(plan, frames, out);
+          continue;
+        }
+        fftw_(execute_dft_r2c)(plan, frames, spectra);
+        for (f = 0; f < nframes; f++)
+          sink(spectra + f * noutput, signal, first + f, ctx);
+      }
+    }
+    return;
+  }
+
+  fftw_(plan) plan = audio_(plan_r2c)(window_size);
+
+  // loop over the input. get a buffer. apply window. call stft. repeat with stride.
+  // each thread owns its buffers; the plan is shared
+#pragma omp parallel num_threads(nthreads) if(parallel)
+  {
+    fft_real *buffer = (fft_real*)audio_scratch(AUDIO_SCRATCH_FRAMES,
+                                                sizeof(fft_real) * window_size);
+    fftw_(complex) *fbuffer = (fftw_(complex)*)audio_scratch(AUDIO_SCRATCH_SPECTRA,
+                                                            sizeof(fftw_(complex)) * noutput);
+    long job;
+#pragma omp for schedule(static)
+    for (job = 0; job < nsignals * nwindows; job++) {
+      long signal = job / nwindows, f = job % nwindows;
+      audio_(frame)(fr->input + signal * fr->sstride + f * stride * istride, istride,
+                    fr->window, buffer, window_size);
+      fftw_(complex) *out = fr->direct ? fr->direct + (signal * nwindows + f) * noutput : NULL;
+      if (out && audio_(direct_ok)(out)) {
+        fftw_(execute_dft_r2c)(plan, buffer, out);
+        continue;
+      }
+      fftw_(execute_dft_r2c)(plan, buffer, fbuffer); // now apply rfftw over the buffer
+      sink(fbuffer, signal, f, ctx);
+    }
+  }
+}
+
+typedef struct {
+  real *output;
+  audio_layout_strides_t st;
+  long noutput;
+  int natural;
+} audio_(stft_sink_t);
+
+// Write one transformed frame into the output, in its layout
+static void audio_(stft_sink)(const fftw_(complex) *fbuffer, long signal,
+                              long frame, void *ctx)
+{
+  const audio_(stft_sink_t) *c = (const audio_(stft_sink_t) *)ctx;
+  const long noutput = c->noutput, bs = c->st.bin, ps = c->st.part;
+  real *output_data = c->output + signal * c->st.signal + frame * c->st.frame;
+  long k;
+  if (c->natural) {
+    for (k = 0; k < noutput; k++) {
+      output_data[k * bs] = (real) fbuffer[k][0];
+      output_data[k * bs + ps] = (real) fbuffer[k][1];
+    }
+  } else {
+    for (k = 0; k < noutput; k++) {
+      output_data[k * bs] = (real) fbuffer[noutput - k - 1][0];
+      output_data[k * bs + ps] = (real) fbuffer[noutput - k - 1][1];
+    }
+  }
+}
+
+// the historical layout, [frames x bins x 2] highest bin first, as used
+// by the streams
+static void audio_(stft_sink_default)(audio_(stft_sink_t) *c, real *output,
+                                      long nwindows, long noutput)
+{
+  audio_layout_t layout = {0, 0, 0};
+  long sizes[3];
+  c->output = output;
+  c->noutput = noutput;
+  c->natural = 0;
+  audio_layout_geometry(&layout, nwindows, noutput, sizes, &c->st);
+}
+
+// The output tensor of a transform: out when the caller passed one in
+// opts.out, else a new tensor. The caller resizes it, which only
+// reallocates out's storage when it has to grow, so transforming same-size
+// inputs into the same out allocates nothing.
+static THTensor * audio_(output)(THTensor *out, THTensor *input)
+{
+  if (out == NULL)
+    return THTensor_(new)();
+  if (out->storage && out->storage == input->storage)
+    THError("[audio] out should not share its storage with the input");
+  return out;
+}
+
+static real * audio_(output_data)(THTensor *output)
+{
+  if (!THTensor_(isContiguous)(output))
+    THError("[audio] out should be contiguous");
+  return THTensor_(data)(output);
+}
+
+// opts.out, if the options table at idx has one
+static THTensor * audio_(check_out)(lua_State *L, int idx)
+{
+  THTensor *out = NULL;
+  if (!lua_istable(L, idx))
+    return NULL;
+  lua_getfield(L, idx, "out");
+  if (!lua_isnil(L, -1)) {
+    out = luaT_toudata(L, -1, torch_Tensor);
+    if (out == NULL)
+      luaL_error(L, "opts.out should be a %s, like the input", torch_Tensor);
+  }
+  lua_pop(L, 1);
+  return out;
+}
+
+// push the result: opts.out itself when it was used, so that no new
+// userdata is made for it either
+static void audio_(push_output)(lua_State *L, THTensor *output, THTensor *out, int idx)
+{
+  if (output == out)
+    lua_getfield(L, idx, "out");
+  else
+    luaT_pushudata(L, output, torch_Tensor);
 }
 
 ////////////////////////////////////////////////////////////////////////////
 // generic short-time fourier transform function that supports multiple window types
 // arguments [tensor, window-size, window-type, hop-size/stride]
-// window_type [1, 2, 3, 4] for [rectangular, hamming, hann, bartlett]
+// window_type [1, 2, 3, 4, 5, 6] for
+// [rectangular, hamming, hann, bartlett, blackman-harris, sqrt-hann]
+// Single-channel input gives [frames x bins x 2]; multi-channel or batch
+// input gives [channels (or batch) x frames x bins x 2]. All signals share
+// one plan, one window table and the same per-thread buffers.
+// opts->layout picks the bin order and the order of the frame, bin and
+// real/imaginary dimensions; the sink writes it directly. In the natural,
+// frame-major, interleaved layout a Float or Double output has exactly the
+// FFT's own layout, so frames are transformed straight into it.
+// The result goes into out when it is not NULL (see audio_(output)).
 static THTensor * audio_(stft_generic)(THTensor *input, 
                                        long window_size, int window_type, 
-                                       long stride)
+                                       long stride, const audio_stft_opts_t *opts,
+                                       THTensor *out)
 {
-  const long length = input->size[0];
-  long nChannels = 1;
+  audio_(frames_t) fr;
+  audio_(frames_init)(&fr, input, window_size, window_type, stride, opts->batch);
+  const audio_layout_t *layout = &opts->layout;
+  audio_(stft_sink_t) ctx;
+  long sizes[3];
+  audio_layout_geometry(layout, fr.nwindows, fr.noutput, sizes, &ctx.st);
+  THTensor *output = audio_(output)(out, input);
+  if (fr.nsignals == 1 && !opts->batch)
+    THTensor_(resize3d)(output, sizes[0], sizes[1], sizes[2]);
+  else
+    THTensor_(resize4d)(output, fr.nsignals, sizes[0], sizes[1], sizes[2]);
+  ctx.output = audio_(output_data)(output);
+  ctx.noutput = fr.noutput;
+  ctx.natural = layout->natural;
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  if (layout->natural && !layout->bin_major && !layout->split)
+    fr.direct = (fftw_(complex) *)ctx.output;
+#endif
+  audio_(frames_run)(&fr, opts->batched, audio_(stft_sink), &ctx);
+  return output;
+}
 
-  if (THTensor_(nDimension)(input) > 1)
-    nChannels = input->size[1];
-  
-  if (nChannels > 1)
-    THError("[stft_generic] Multi-channel stft not supported");
+typedef struct {
+  real *output;
+  long nwindows, noutput;
+  int mode;
+} audio_(spectrogram_sink_t);
 
-  real *input_data = THTensor_(data)(input);
-  const long nwindows = ((length - window_size)/stride) + 1;
-  const long noutput = window_size/2 + 1;
-  THTensor *output = THTensor_(newWithSize3d)(nwindows, noutput, 2);
+// Reduce one frame to magnitude, power or log-power and write it as a
+// column of the [bins x frames] output, highest frequency bin first
+static void audio_(spectrogram_sink)(const fftw_(complex) *fbuffer, long signal,
+                                     long frame, void *ctx)
+{
+  const audio_(spectrogram_sink_t) *c = (const audio_(spectrogram_sink_t) *)ctx;
+  const long noutput = c->noutput, nwindows = c->nwindows;
+  real *out = c->output + signal * noutput * nwindows + frame;
+  long k;
+  for (k = 0; k < noutput; k++) {
+    double re = fbuffer[noutput - k - 1][0], im = fbuffer[noutput - k - 1][1];
+    out[k * nwindows] = (real) audio_spec_scale(re * re + im * im, c->mode);
+  }
+}
+
+// spectrogram without the intermediate complex tensor: each frame's spectrum
+// is reduced in place as it leaves the FFT. Single-channel input gives
+// [bins x frames]; multi-channel or batch input gives [channels x bins x frames].
+// The result goes into out when it is not NULL (see audio_(output)).
+static THTensor * audio_(spectrogram_generic)(THTensor *input,
+                                              long window_size, int window_type,
+                                              long stride, int mode,
+                                              const audio_stft_opts_t *opts,
+                                              THTensor *out)
+{
+  if (mode < AUDIO_SPEC_MAGNITUDE || mode > AUDIO_SPEC_DB)
+    THError("[spectrogram] unknown mode %d", mode);
+  audio_(frames_t) fr;
+  audio_(frames_init)(&fr, input, window_size, window_type, stride, opts->batch);
+  THTensor *output = audio_(output)(out, input);
+  if (fr.nsignals == 1 && !opts->batch)
+    THTensor_(resize2d)(output, fr.noutput, fr.nwindows);
+  else
+    THTensor_(resize3d)(output, fr.nsignals, fr.noutput, fr.nwindows);
+  audio_(spectrogram_sink_t) ctx = {audio_(output_data)(output), fr.nwindows, fr.noutput, mode};
+  audio_(frames_run)(&fr, opts->batched, audio_(spectrogram_sink), &ctx);
+  return output;
+}
+
+// power of one spectrum through mel filter j
+static double audio_(mel_band)(const fftw_(complex) *spectrum,
+                               const audio_mel_entry_t *mel, int j)
+{
+  const fftw_(complex) *bins = spectrum + mel->start[j];
+  const double *w = mel->coef[j];
+  double sum = 0;
+  long k;
+  for (k = 0; k < mel->count[j]; k++)
+    sum += w[k] * ((double)bins[k][0] * bins[k][0] + (double)bins[k][1] * bins[k][1]);
+  return sum;
+}
+
+typedef struct {
+  real *output;
+  long nwindows;
+  const audio_mel_entry_t *mel;
+  int mode;
+} audio_(mel_sink_t);
+
+// Filter one frame's power spectrum into the [mels x frames] output,
+// lowest band first
+static void audio_(mel_sink)(const fftw_(complex) *fbuffer, long signal,
+                             long frame, void *ctx)
+{
+  const audio_(mel_sink_t) *c = (const audio_(mel_sink_t) *)ctx;
+  const int n_mels = c->mel->n_mels;
+  real *out = c->output + signal * n_mels * c->nwindows + frame;
+  int j;
+  for (j = 0; j < n_mels; j++)
+    out[j * c->nwindows] = (real) audio_spec_scale(audio_(mel_band)(fbuffer, c->mel, j), c->mode);
+}
+
+static const audio_mel_entry_t *audio_(mel_filters)(const audio_(frames_t) *fr,
+                                                     double sample_rate,
+                                                     const audio_mel_opts_t *mopts)
+{
+  double fmax = mopts->fmax < 0 ? sample_rate / 2 : mopts->fmax;
+  return audio_mel(sample_rate, fr->window_size, mopts->n_mels, mopts->fmin, fmax);
+}
+
+// mel spectrogram: stft power filtered through a cached sparse mel
+// filterbank as each frame leaves the FFT. Single-channel input gives
+// [mels x frames]; multi-channel or batch input gives [channels x mels x frames].
+static THTensor * audio_(melspectrogram_generic)(THTensor *input,
+                                                 long window_size, int window_type,
+                                                 long stride, double sample_rate,
+                                                 int mode, const audio_stft_opts_t *opts,
+                                                 const audio_mel_opts_t *mopts)
+{
+  if (mode < AUDIO_SPEC_MAGNITUDE || mode > AUDIO_SPEC_DB)
+    THError("[melspectrogram] unknown mode %d", mode);
+  audio_(frames_t) fr;
+  audio_(frames_init)(&fr, input, window_size, window_type, stride, opts->batch);
+  const audio_mel_entry_t *mel = audio_(mel_filters)(&fr, sample_rate, mopts);
+  THTensor *output;
+  if (fr.nsignals == 1 && !opts->batch)
+    output = THTensor_(newWithSize2d)(mel->n_mels, fr.nwindows);
+  else
+    output = THTensor_(newWithSize3d)(fr.nsignals, mel->n_mels, fr.nwindows);
+  audio_(mel_sink_t) ctx = {THTensor_(data)(output), fr.nwindows, mel, mode};
+  audio_(frames_run)(&fr, opts->batched, audio_(mel_sink), &ctx);
+  return output;
+}
+
+typedef struct {
+  fft_real *logmel; // [signals x frames x mels]
+  long nwindows;
+  const audio_mel_entry_t *mel;
+} audio_(logmel_sink_t);
+
+// natural log of the mel energies, one contiguous row per frame for the DCT
+static void audio_(logmel_sink)(const fftw_(complex) *fbuffer, long signal,
+                                long frame, void *ctx)
+{
+  const audio_(logmel_sink_t) *c = (const audio_(logmel_sink_t) *)ctx;
+  const int n_mels = c->mel->n_mels;
+  fft_real *row = c->logmel + (signal * c->nwindows + frame) * n_mels;
+  int j;
+  for (j = 0; j < n_mels; j++) {
+    double p = audio_(mel_band)(fbuffer, c->mel, j);
+    row[j] = (fft_real) log(p > 1e-10 ? p : 1e-10);
+  }
+}
+
+// MFCC: orthonormal DCT-II of the log mel energies, first n_mfcc
+// coefficients. The DCT is a cached FFTW REDFT10 plan. Single-channel input
+// gives [n_mfcc x frames]; multi-channel or batch input gives
+// [channels x n_mfcc x frames].
+static THTensor * audio_(mfcc_generic)(THTensor *input,
+                                       long window_size, int window_type,
+                                       long stride, double sample_rate,
+                                       const audio_stft_opts_t *opts,
+                                       const audio_mel_opts_t *mopts)
+{
+  audio_(frames_t) fr;
+  audio_(frames_init)(&fr, input, window_size, window_type, stride, opts->batch);
+  const audio_mel_entry_t *mel = audio_(mel_filters)(&fr, sample_rate, mopts);
+  const int n_mels = mel->n_mels, n_mfcc = mopts->n_mfcc;
+  if (n_mfcc < 1 || n_mfcc > n_mels)
+    THError("[mfcc] n_mfcc should be between 1 and n_mels");
+  const long nwindows = fr.nwindows, nrows = fr.nsignals * nwindows;
+  THTensor *output;
+  if (fr.nsignals == 1 && !opts->batch)
+    output = THTensor_(newWithSize2d)(n_mfcc, nwindows);
+  else
+    output = THTensor_(newWithSize3d)(fr.nsignals, n_mfcc, nwindows);
   real *output_data = THTensor_(data)(output);
-  double *buffer = malloc(sizeof(double) * window_size);
-  fftw_complex *fbuffer = (fftw_complex*)fftw_malloc(sizeof(fftw_complex)*noutput);
-  long index, k, outindex=0;
 
-  fftw_plan plan = fftw_plan_dft_r2c_1d(window_size, buffer, fbuffer, FFTW_ESTIMATE);
+  fft_real *logmel = (fft_real *)fftw_(malloc)(sizeof(fft_real) * nrows * n_mels);
+  audio_(logmel_sink_t) ctx = {logmel, nwindows, mel};
+  audio_(frames_run)(&fr, opts->batched, audio_(logmel_sink), &ctx);
 
-  // loop over the input. get a buffer. apply window. call stft. repeat with stride.
-  for (index = 0; index + window_size <= length; index = index + stride) {
-    for (k=0; k<window_size; k++)
-      buffer[k] = (double)input_data[index+k];
-
-    audio_(apply_window)(buffer, window_size, window_type);
-    fftw_execute(plan);     // now apply rfftw over the buffer
-        
-    for (k=0; k < noutput; k++) {
-      output_data[outindex + k * 2] = (real) fbuffer[noutput - k - 1][0];
-      output_data[outindex + k * 2 + 1] = (real) fbuffer[noutput - k - 1][1];
+  fftw_(plan) plan = audio_(plan_dct2)(n_mels);
+  // REDFT10 computes 2 sum x_n cos(pi k (n + 1/2) / N); scale to orthonormal
+  const double scale0 = sqrt(1. / (4 * n_mels)), scale = sqrt(1. / (2 * n_mels));
+  const int nthreads = audio_threads();
+#pragma omp parallel num_threads(nthreads) if(nthreads > 1 && nrows * n_mels >= AUDIO_PARALLEL_MIN)
+  {
+    fft_real *in = (fft_real *)fftw_(malloc)(sizeof(fft_real) * n_mels);
+    fft_real *out = (fft_real *)fftw_(malloc)(sizeof(fft_real) * n_mels);
+    long row;
+    int c;
+#pragma omp for schedule(static)
+    for (row = 0; row < nrows; row++) {
+      long signal = row / nwindows, f = row % nwindows;
+      memcpy(in, logmel + row * n_mels, sizeof(fft_real) * n_mels);
+      fftw_(execute_r2r)(plan, in, out);
+      real *dst = output_data + signal * n_mfcc * nwindows + f;
+      for (c = 0; c < n_mfcc; c++)
+        dst[c * nwindows] = (real) (out[c] * (c == 0 ? scale0 : scale));
     }
-    outindex += noutput *2;
+    fftw_(free)(out);
+    fftw_(free)(in);
   }
+  fftw_(free)(logmel);
+  return output;
+}
 
-  // cleanup
-  fftw_destroy_plan(plan);
-  fftw_free(fbuffer);
-  free(buffer);
+////////////////////////////////////////////////////////////////////////////
+// Inverse STFT by weighted overlap-add. Each frame is inverse transformed,
+// windowed again with the analysis window and added into the output, which
+// is then divided by the sum of the squared windows (the least-squares
+// inverse, exact for unmodified spectra where that sum is nonzero).
+
+// one frame of stft output back to a windowed time-domain frame. The
+// frame's bins are bstride apart and its imaginary parts pstride after the
+// real ones, highest frequency bin first unless natural. cbuffer is
+// scratch for the c2r transform, which overwrites its input.
+static void audio_(synth_frame)(const real *spectrum, long bstride, long pstride,
+                                int natural, fftw_(plan) plan,
+                                const fft_real *window, long window_size,
+                                fftw_(complex) *cbuffer, fft_real *out)
+{
+  const long noutput = window_size / 2 + 1;
+  const fft_real scale = (fft_real)1 / window_size;
+  long k;
+  for (k = 0; k < noutput; k++) {
+    const real *bin = spectrum + (natural ? k : noutput - k - 1) * bstride;
+    cbuffer[k][0] = (fft_real) bin[0];
+    cbuffer[k][1] = (fft_real) bin[pstride];
+  }
+  fftw_(execute_dft_c2r)(plan, cbuffer, out);
+  for (k = 0; k < window_size; k++)
+    out[k] *= window[k] * scale;
+}
+
+// arguments [stft tensor, window-size, window-type, hop-size/stride]
+// [frames x bins x 2] gives [samples]; [channels x frames x bins x 2] gives
+// [samples x channels], or [batch x samples] with opts->batch, mirroring
+// the layouts stft_generic accepts. opts->layout describes the input as it
+// does stft_generic's output.
+static THTensor * audio_(istft_generic)(THTensor *input,
+                                        long window_size, int window_type,
+                                        long stride, const audio_stft_opts_t *opts)
+{
+  const int ndim = THTensor_(nDimension)(input);
+  const long noutput = window_size / 2 + 1;
+  const audio_layout_t *layout = &opts->layout;
+  if (ndim != 3 && ndim != 4)
+    THError("[istft] input should be frames x bins x 2, or have a leading channel dimension");
+  const long nsignals = ndim == 4 ? input->size[0] : 1;
+  const long nframes = input->size[ndim - 3 + audio_layout_frame_dim(layout)];
+  long sizes[3];
+  audio_layout_strides_t st;
+  audio_layout_geometry(layout, nframes, noutput, sizes, &st);
+  if (input->size[ndim - 3] != sizes[0] || input->size[ndim - 2] != sizes[1]
+      || input->size[ndim - 1] != sizes[2])
+    THError("[istft] input should have window_size/2+1 bins of 2 (real, imaginary) values");
+  if (nframes < 1)
+    THError("[istft] input has no frames");
+  const audio_ola_entry_t *ola = audio_ola(window_type, window_size, stride);
+  const fft_real *window = audio_window_coef(ola->window);
+  const long length = (nframes - 1) * stride + window_size;
+
+  THTensor *output;
+  long ostride, sstride; // between samples, and between signals
+  if (ndim == 3) {
+    output = THTensor_(newWithSize1d)(length);
+    ostride = 1;
+    sstride = 0;
+  } else if (opts->batch) {
+    output = THTensor_(newWithSize2d)(nsignals, length);
+    ostride = 1;
+    sstride = length;
+  } else {
+    output = THTensor_(newWithSize2d)(length, nsignals);
+    ostride = nsignals;
+    sstride = 1;
+  }
+  THTensor_(zero)(output);
+  real *output_data = THTensor_(data)(output);
+  THTensor *spectra = THTensor_(newContiguous)(input);
+  const real *spectra_data = THTensor_(data)(spectra);
+
+  fftw_(plan) plan = audio_(plan_c2r)(window_size);
+  // frames are synthesized a block at a time, in parallel, then added
+  // into the output in order since neighbouring frames overlap
+  const long howmany = audio_batch_frames(window_size, nframes, sizeof(fft_real));
+  fft_real *frames = (fft_real *)fftw_(malloc)(sizeof(fft_real) * window_size * howmany);
+  const int nthreads = audio_threads();
+  const int parallel = nthreads > 1 && howmany > 1
+    && nsignals * nframes * window_size >= AUDIO_PARALLEL_MIN;
+  long signal, first, f, j;
+  for (signal = 0; signal < nsignals; signal++) {
+    real *out = output_data + signal * sstride;
+    for (first = 0; first < nframes; first += howmany) {
+      const long count = nframes - first < howmany ? nframes - first : howmany;
+#pragma omp parallel num_threads(nthreads) if(parallel)
+      {
+        fftw_(complex) *cbuffer = (fftw_(complex) *)fftw_(malloc)(sizeof(fftw_(complex)) * noutput);
+        long g;
+#pragma omp for schedule(static)
+        for (g = 0; g < count; g++)
+          audio_(synth_frame)(spectra_data + signal * st.signal + (first + g) * st.frame,
+                              st.bin, st.part, layout->natural, plan, window,
+                              window_size, cbuffer, frames + g * window_size);
+        fftw_(free)(cbuffer);
+      }
+      for (f = 0; f < count; f++) {
+        real *dst = out + (first + f) * stride * ostride;
+        const fft_real *src = frames + f * window_size;
+        for (j = 0; j < window_size; j++)
+          dst[j * ostride] += (real) src[j];
+      }
+    }
+    for (j = 0; j < length; j++)
+      out[j * ostride] = (real) (out[j * ostride] * audio_ola_norm(ola, j, nframes));
+  }
+  fftw_(free)(frames);
+  THTensor_(free)(spectra);
   return output;
 }
 
@@ -125,93 +702,362 @@ static int audio_(Main_stft)(lua_State *L) {
   long window_size = luaL_checklong(L, 2);
   int window_type = luaL_checkint(L, 3);
   long stride = luaL_checklong(L, 4);
-  THTensor *output = audio_(stft_generic)(input, window_size, window_type, stride);
+  audio_stft_opts_t opts;
+  audio_check_stft_opts(L, 5, &opts);
+  THTensor *out = audio_(check_out)(L, 5);
+  THTensor *output = audio_(stft_generic)(input, window_size, window_type, stride,
+                                          &opts, out);
+  audio_(push_output)(L, output, out, 5);
+  return 1;
+}
+
+static int audio_(Main_istft)(lua_State *L) {
+  THTensor *input = luaT_checkudata(L, 1, torch_Tensor);
+  long window_size = luaL_checklong(L, 2);
+  int window_type = luaL_checkint(L, 3);
+  long stride = luaL_checklong(L, 4);
+  audio_stft_opts_t opts;
+  audio_check_stft_opts(L, 5, &opts);
+  THTensor *output = audio_(istft_generic)(input, window_size, window_type, stride, &opts);
   luaT_pushudata(L, output, torch_Tensor);
   return 1;
 }
+
+static int audio_(Main_spectrogram)(lua_State *L) {
+  THTensor *input = luaT_checkudata(L, 1, torch_Tensor);
+  long window_size = luaL_checklong(L, 2);
+  int window_type = luaL_checkint(L, 3);
+  long stride = luaL_checklong(L, 4);
+  int mode = luaL_optint(L, 5, AUDIO_SPEC_LOG);
+  audio_stft_opts_t opts;
+  audio_check_stft_opts(L, 6, &opts);
+  THTensor *out = audio_(check_out)(L, 6);
+  THTensor *output = audio_(spectrogram_generic)(input, window_size, window_type,
+                                                 stride, mode, &opts, out);
+  audio_(push_output)(L, output, out, 6);
+  return 1;
+}
+
+static int audio_(Main_melspectrogram)(lua_State *L) {
+  THTensor *input = luaT_checkudata(L, 1, torch_Tensor);
+  long window_size = luaL_checklong(L, 2);
+  int window_type = luaL_checkint(L, 3);
+  long stride = luaL_checklong(L, 4);
+  double sample_rate = luaL_checknumber(L, 5);
+  int mode = luaL_optint(L, 6, AUDIO_SPEC_POWER);
+  audio_stft_opts_t opts;
+  audio_mel_opts_t mopts;
+  audio_check_stft_opts(L, 7, &opts);
+  audio_check_mel_opts(L, 7, &mopts);
+  THTensor *output = audio_(melspectrogram_generic)(input, window_size, window_type,
+                                                    stride, sample_rate, mode,
+                                                    &opts, &mopts);
+  luaT_pushudata(L, output, torch_Tensor);
+  return 1;
+}
+
+static int audio_(Main_mfcc)(lua_State *L) {
+  THTensor *input = luaT_checkudata(L, 1, torch_Tensor);
+  long window_size = luaL_checklong(L, 2);
+  int window_type = luaL_checkint(L, 3);
+  long stride = luaL_checklong(L, 4);
+  double sample_rate = luaL_checknumber(L, 5);
+  audio_stft_opts_t opts;
+  audio_mel_opts_t mopts;
+  audio_check_stft_opts(L, 6, &opts);
+  audio_check_mel_opts(L, 6, &mopts);
+  THTensor *output = audio_(mfcc_generic)(input, window_size, window_type,
+                                          stride, sample_rate, &opts, &mopts);
+  luaT_pushudata(L, output, torch_Tensor);
+  return 1;
+}
+
 // End of STFT section
 ////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////
+// Streaming STFT (audio.STFTStream). The handle and its ring buffer are in
+// audio.c; these push samples through it in the precision of the tensor.
+
+// window and transform the frame starting at absolute sample pos; samples
+// past the end of the stream are zeros
+static void audio_(stream_frame)(audio_stft_stream_t *s, fftw_(plan) plan,
+                                 long pos, real *output, long frame)
+{
+  const long window_size = s->window_size;
+  const double *src = s->ring + pos % window_size;
+  const fft_real *window = audio_window_coef(s->window);
+  fft_real *buffer = (fft_real *)s->buffer;
+  long avail = s->total - pos < window_size ? s->total - pos : window_size;
+  long j;
+  for (j = 0; j < avail; j++)
+    buffer[j] = (fft_real)(src[j] * window[j]);
+  for (; j < window_size; j++)
+    buffer[j] = 0;
+  fftw_(execute_dft_r2c)(plan, buffer, (fftw_(complex) *)s->fbuffer);
+  audio_(stft_sink_t) ctx;
+  audio_(stft_sink_default)(&ctx, output, 0, window_size / 2 + 1);
+  audio_(stft_sink)((const fftw_(complex) *)s->fbuffer, 0, frame, &ctx);
+}
+
+static void audio_(stream_output)(THTensor *output, long nframes, long noutput)
+{
+  if (nframes > 0)
+    THTensor_(resize3d)(output, nframes, noutput, 2);
+  else
+    THTensor_(resize1d)(output, 0);
+}
+
+// arguments [stream, 1D chunk, output tensor]
+// returns [number of frames completed by this chunk], written to output as
+// [frames x bins x 2]. The output's storage is reused between calls.
+static int audio_(Main_stft_push)(lua_State *L) {
+  audio_stft_stream_t *s = audio_checkstftstream(L, 1);
+  THTensor *chunk = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *output = luaT_checkudata(L, 3, torch_Tensor);
+  if (s->ring == NULL)
+    luaL_error(L, "[stft_push] stream is closed");
+  if (THTensor_(nDimension)(chunk) > 1)
+    luaL_error(L, "[stft_push] chunk should be 1D");
+  const long window_size = s->window_size, noutput = window_size / 2 + 1;
+  const long n = THTensor_(nElement)(chunk);
+  const long end = s->total + n;
+  const long nframes = end >= s->head + window_size
+    ? (end - s->head - window_size) / s->hop + 1 : 0;
+  audio_(stream_output)(output, nframes, noutput);
+  if (n > 0) {
+    fftw_(plan) plan = audio_(plan_r2c)(window_size);
+    real *in = THTensor_(data)(chunk), *output_data = THTensor_(data)(output);
+    const long stride = chunk->stride[0];
+    long i, f = 0;
+    for (i = 0; i < n; i++) {
+      long p = s->total % window_size;
+      s->ring[p] = s->ring[p + window_size] = (double)in[i * stride];
+      if (++s->total == s->head + window_size) {
+        audio_(stream_frame)(s, plan, s->head, output_data, f++);
+        s->covered = s->head + window_size;
+        s->head += s->hop;
+      }
+    }
+  }
+  lua_pushnumber(L, (double)nframes);
+  return 1;
+}
+
+// arguments [stream, output tensor]
+// returns [number of frames], the zero-padded frames that cover the samples
+// no complete frame has covered yet. The stream then starts over.
+static int audio_(Main_stft_flush)(lua_State *L) {
+  audio_stft_stream_t *s = audio_checkstftstream(L, 1);
+  THTensor *output = luaT_checkudata(L, 2, torch_Tensor);
+  if (s->ring == NULL)
+    luaL_error(L, "[stft_flush] stream is closed");
+  const long window_size = s->window_size, noutput = window_size / 2 + 1;
+  long nframes = 0, pos, covered;
+  for (pos = s->head, covered = s->covered; covered < s->total && pos < s->total;
+       pos += s->hop, covered = pos - s->hop + window_size)
+    nframes++;
+  audio_(stream_output)(output, nframes, noutput);
+  if (nframes > 0) {
+    fftw_(plan) plan = audio_(plan_r2c)(window_size);
+    long f;
+    for (f = 0; f < nframes; f++)
+      audio_(stream_frame)(s, plan, s->head + f * s->hop, THTensor_(data)(output), f);
+  }
+  audio_stft_stream_clear(s);
+  lua_pushnumber(L, (double)nframes);
+  return 1;
+}
+// End of streaming STFT section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Streaming inverse STFT (audio.ISTFTStream); the handle is in audio.c.
+
+// arguments [stream, frames (frames x bins x 2, or bins x 2), output tensor]
+// returns [number of finished samples], hop per frame, written to output.
+// The output's storage is reused between calls.
+static int audio_(Main_istft_push)(lua_State *L) {
+  audio_istft_stream_t *s = audio_checkistftstream(L, 1);
+  THTensor *input = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *output = luaT_checkudata(L, 3, torch_Tensor);
+  if (s->acc == NULL)
+    luaL_error(L, "[istft_push] stream is closed");
+  const long window_size = s->window_size, hop = s->hop, noutput = window_size / 2 + 1;
+  const int ndim = THTensor_(nDimension)(input);
+  if ((ndim != 2 && ndim != 3) || input->size[ndim - 2] != noutput || input->size[ndim - 1] != 2)
+    luaL_error(L, "[istft_push] frames should be frames x window_size/2+1 x 2");
+  const long nframes = ndim == 3 ? input->size[0] : 1;
+  if (nframes > 0)
+    THTensor_(resize1d)(output, nframes * hop);
+  else
+    THTensor_(resize1d)(output, 0);
+  if (nframes > 0) {
+    fftw_(plan) plan = audio_(plan_c2r)(window_size);
+    const fft_real *window = audio_window_coef(s->ola->window);
+    THTensor *spectra = THTensor_(newContiguous)(input);
+    const real *spectra_data = THTensor_(data)(spectra);
+    real *output_data = THTensor_(data)(output);
+    fft_real *buffer = (fft_real *)s->buffer;
+    long f, j;
+    for (f = 0; f < nframes; f++) {
+      audio_(synth_frame)(spectra_data + f * noutput * 2, 2, 1, 0, plan, window,
+                          window_size, (fftw_(complex) *)s->cbuffer, buffer);
+      for (j = 0; j < window_size; j++)
+        s->acc[j] += buffer[j];
+      // the first hop samples are final; more frames are assumed to follow
+      const long first = s->nframes * hop;
+      for (j = 0; j < hop; j++) {
+        long n = first + j;
+        double norm = n < window_size - hop ? s->ola->head[n] : s->ola->period[n % hop];
+        output_data[f * hop + j] = (real) (s->acc[j] * norm);
+      }
+      memmove(s->acc, s->acc + hop, sizeof(double) * (window_size - hop));
+      memset(s->acc + window_size - hop, 0, sizeof(double) * hop);
+      s->nframes++;
+    }
+    THTensor_(free)(spectra);
+  }
+  lua_pushnumber(L, (double)(nframes * hop));
+  return 1;
+}
+
+// arguments [stream, output tensor]
+// returns [number of samples], the window_size - hop samples the last
+// frame still overlaps, normalized as the end of the signal. The stream
+// then starts over.
+static int audio_(Main_istft_flush)(lua_State *L) {
+  audio_istft_stream_t *s = audio_checkistftstream(L, 1);
+  THTensor *output = luaT_checkudata(L, 2, torch_Tensor);
+  if (s->acc == NULL)
+    luaL_error(L, "[istft_flush] stream is closed");
+  const long nsamples = s->nframes > 0 ? s->window_size - s->hop : 0;
+  if (nsamples > 0) {
+    THTensor_(resize1d)(output, nsamples);
+    real *output_data = THTensor_(data)(output);
+    const long first = s->nframes * s->hop;
+    long j;
+    for (j = 0; j < nsamples; j++)
+      output_data[j] = (real) (s->acc[j] * audio_ola_norm(s->ola, first + j, s->nframes));
+  } else {
+    THTensor_(resize1d)(output, 0);
+  }
+  audio_istft_stream_clear(s);
+  lua_pushnumber(L, (double)nsamples);
+  return 1;
+}
+// End of streaming inverse STFT section
+////////////////////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////////////////////
 // fast Constant-Q transform as proposed in this paper:
 // http://www.elec.qmul.ac.uk/people/anssik/cqt/smc2010.pdf
 // Inspired the matlab implementation here:
 // http://www.eecs.qmul.ac.uk/~anssik/cqt/
 
-static THTensor * audio_(genCQTkernel)(double fmax, int bins,
-                                       double fs, double q, double atomHopFactor,
-				       double thres)
-{
-  // TODO: write this
-  THTensor *output;
-  return output;
-}
-
 // arguments [tensor, minimum-frequency, maximum-frequency, bins-per-octave, sample-rate]
 // returns [Constant-Q transformed signal tensor]
+// The output is [octaves*bins x frames x 2] (complex), lowest frequency
+// first. Frame t is centred on input sample t*atom_hop, the hop of the
+// top octave; the coarser octaves hold each coefficient over the frames
+// nearest to its centre. Each octave is framed into fft_len blocks that are
+// transformed together with one many-plan execution per block of frames,
+// then the signal is low-passed (zero-phase) and decimated by two.
 static THTensor * audio_(cqt_generic)(THTensor *input, 
                                        double fmin, double fmax, int bins,
                                        double fs)
 {
-  // Check the input to be 1-D
-  // input parameters
-  double q = 1; // default value
-  double atomHopFactor = 0.25; // default value
-  double thresh = 0.0005; // default value
-  THTensor* output;
-  // winFlag = 'sqrt_blackmanharris'; // This window scheme
-  
-  // define
-  double octaveNr = ceil(log2(fmax/fmin));
-  fmin = (fmax/exp2(octaveNr)) * exp2(1/(double)bins); // set fmin to actual value
-  // xlen_init = length(x); // not needed for now
-
-  // design lowpass filter
-  /* TODO:
-    if ~exist('B','var') || ~exist('A','var')
-    LPorder = 6; %order of the anti-aliasing filter
-    cutoff = 0.5;
-    [B A] = butter(LPorder,cutoff,'low'); %design f_nyquist/2-lowpass filter
-    end
-  */
-  
-  // design kernel for one octave
-  // TODO: Fill this function, right now it's empty
-  THTensor* cqtKernel = audio_(genCQTkernel)(fmax, bins,fs,q,atomHopFactor,thresh);
-
-  // calculate CQT
-  /* TODO: 
-     cellCQT = cell(1,octaveNr);
-     maxBlock = cqtKernel.fftLEN * 2^(octaveNr-1); // largest FFT Block (virtual)
-     suffixZeros = maxBlock;
-     prefixZeros = maxBlock;
-     x = [zeros(prefixZeros,1); x; zeros(suffixZeros,1)]; // zeropadding
-     OVRLP = cqtKernel.fftLEN - cqtKernel.fftHOP;
-     K = cqtKernel.fKernel'; // conjugate spectral kernel for cqt transformation  
-  */
-  /* 
-  for (long i=1; i < octaveNr; ++i) {
-    xx = buffer(x,cqtKernel.fftLEN, OVRLP,'nodelay'); // generating FFT blocks
-    XX = fft(xx); // applying fft to each column (each FFT frame)
-    cellCQT{i} = K*XX; // calculating cqt coefficients for all FFT frames for this octave
-    if (i !=octaveNr) {
-      x = filtfilt(B,A,x); // anti aliasing filter
-      x = x(1:2:end); // drop samplerate by 2
+  if (THTensor_(nDimension)(input) != 1)
+    THError("[cqt] input should be 1D");
+  const long len = input->size[0], istride = input->stride[0];
+  if (len < 1)
+    THError("[cqt] input is empty");
+  const audio_cqt_kernel_t *K = audio_cqt_kernel(fmin, fmax, bins, fs);
+  const long N = K->fft_len, H = K->fft_hop, A = K->atom_hop, W = K->atoms;
+  const long noutput = N / 2 + 1;
+  const int octaves = K->octaves;
+  const long nframes = (len - 1) / A + 1;
+  THTensor *output = THTensor_(newWithSize3d)((long)octaves * bins, nframes, 2);
+  real *output_data = THTensor_(data)(output);
+
+  // zero padding on both sides leaves room for the frames that straddle
+  // the ends and for the anti-aliasing filter to ring out
+  const long pad = N << (octaves - 1);
+  long n = len + 2 * pad;
+  n = ((n + (1L << (octaves - 1)) - 1) >> (octaves - 1)) << (octaves - 1);
+  double *x = (double *)calloc(n, sizeof(double));
+  real *input_data = THTensor_(data)(input);
+  long i;
+  for (i = 0; i < len; i++)
+    x[pad + i] = (double)input_data[i * istride];
+  double sos[AUDIO_CQT_LP_SECTIONS][5];
+  audio_cqt_lowpass(sos);
+
+  const int nthreads = audio_threads();
+  int o;
+  for (o = 0; o < octaves; o++) {
+    const long origin = (pad >> o) - K->first_center; // first frame's start
+    const long half = o > 0 ? 1L << (o - 1) : 0;
+    const long natoms = ((nframes - 1 + half) >> o) + 1;
+    const long nfft = (natoms + W - 1) / W;
+    const long howmany = audio_batch_frames(N, nfft, sizeof(fft_real));
+    const long nblocks = (nfft + howmany - 1) / howmany;
+    fftw_(plan) plan = audio_(plan_r2c_many)(N, howmany);
+    const int parallel = nthreads > 1 && nblocks > 1
+      && nfft * N >= AUDIO_PARALLEL_MIN;
+#pragma omp parallel num_threads(nthreads) if(parallel)
+    {
+      fft_real *frames = (fft_real *)fftw_(malloc)(sizeof(fft_real) * N * howmany);
+      fftw_(complex) *spectra = (fftw_(complex) *)fftw_(malloc)(sizeof(fftw_(complex)) * noutput * howmany);
+      long block, f, j, r;
+      int k;
+#pragma omp for schedule(static)
+      for (block = 0; block < nblocks; block++) {
+        long first = block * howmany;
+        long count = nfft - first < howmany ? nfft - first : howmany;
+        for (f = 0; f < howmany; f++) {
+          fft_real *dst = frames + f * N;
+          long start = origin + (first + f) * H;
+          for (j = 0; j < N; j++)
+            dst[j] = (f < count && start + j >= 0 && start + j < n) ? (fft_real)x[start + j] : 0;
+        }
+        fftw_(execute_dft_r2c)(plan, frames, spectra);
+        for (f = 0; f < count; f++) {
+          const fftw_(complex) *X = spectra + f * noutput;
+          for (k = 0; k < bins; k++) {
+            real *row = output_data + ((long)(octaves - 1 - o) * bins + k) * nframes * 2;
+            for (j = 0; j < W; j++) {
+              long atom = (first + f) * W + j;
+              if (atom >= natoms)
+                break;
+              long a = k * W + j;
+              const double *c = K->coef[a];
+              const fftw_(complex) *Xa = X + K->start[a];
+              double re = 0, im = 0;
+              for (r = 0; r < K->count[a]; r++) {
+                re += c[2 * r] * Xa[r][0] - c[2 * r + 1] * Xa[r][1];
+                im += c[2 * r] * Xa[r][1] + c[2 * r + 1] * Xa[r][0];
+              }
+              long t0 = (atom << o) - half, t1 = t0 + (1L << o), t;
+              if (t0 < 0)
+                t0 = 0;
+              if (t1 > nframes)
+                t1 = nframes;
+              for (t = t0; t < t1; t++) {
+                row[t * 2] = (real) re;
+                row[t * 2 + 1] = (real) im;
+              }
+            }
+          }
+        }
+      }
+      fftw_(free)(spectra);
+      fftw_(free)(frames);
     }
+    if (o < octaves - 1)
+      n = audio_cqt_decimate(x, n, sos);
   }
-  */
-  
-  // map to sparse matrix representation
-  /* TODO: this should be optional, unless we want a sparse representation to save memory
-  spCQT = cell2sparse(cellCQT,octaveNr,bins,cqtKernel.firstcenter,cqtKernel.atomHOP,cqtKernel.atomNr);
-  */
-  
-  // return
-  /* TODO: No need to created this structure. Just returning transformed x (tensor) should be sufficient
-  intParam = struct('sufZeros',suffixZeros,'preZeros',prefixZeros,'xlen_init',xlen_init,'fftLEN',cqtKernel.fftLEN,'fftHOP',cqtKernel.fftHOP,'q',q,'filtCoeffA',A,'filtCoeffB',B,'firstcenter',cqtKernel.firstcenter,'atomHOP',cqtKernel.atomHOP,'atomNr',cqtKernel.atomNr,'Nk_max',cqtKernel.Nk_max,'Q',cqtKernel.Q,'rast',0);
-  Xcqt = struct('spCQT',spCQT,'fKernel',cqtKernel.fKernel,'fmax',fmax,'fmin',fmin,'octaveNr',octaveNr,'bins',cqtKernel.bins,'intParams',intParam);
-  */
-  
+  free(x);
   return output;
 }
 
@@ -220,7 +1066,7 @@ static int audio_(Main_cqt)(lua_State *L) {
   double fmin = luaL_checknumber(L, 2);
   double fmax = luaL_checknumber(L, 3);
   int bins = luaL_checkint(L, 4);
-  long sample_rate = luaL_checknumber(L, 5);
+  double sample_rate = luaL_checknumber(L, 5);
   THTensor *output = audio_(cqt_generic)(input, fmin, fmax, bins, sample_rate);
   luaT_pushudata(L, output, torch_Tensor);
   return 1;
@@ -228,9 +1074,91 @@ static int audio_(Main_cqt)(lua_State *L) {
 // End of CQT section
 ////////////////////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////////////////////
+// Sample rate conversion (see resample.h). Channels are independent, so
+// each is resampled by its own streaming state, in parallel.
+
+// arguments [tensor (samples, or samples x channels), from rate, to rate]
+// returns a tensor of the same layout and type at the new rate, with
+// ceil(samples * to / from) samples
+static THTensor * audio_(resample_generic)(THTensor *input, long from, long to)
+{
+  const int ndim = THTensor_(nDimension)(input);
+  if (ndim < 1 || ndim > 2)
+    THError("[resample] input should be 1D or 2D (samples x channels)");
+  const char *err = audio_resample_check(from, to);
+  if (err)
+    THError("%s", err);
+  if (from == to)
+    return THTensor_(newClone)(input);
+  const audio_resample_kernel_t *k = audio_resample_kernel(from, to);
+  const long length = input->size[0], istride = input->stride[0];
+  const long nchannels = ndim == 2 ? input->size[1] : 1;
+  const long cstride = ndim == 2 ? input->stride[1] : 0;
+  const long olength = audio_resample_length(k, length);
+  THTensor *output = ndim == 2 ? THTensor_(newWithSize2d)(olength, nchannels)
+    : THTensor_(newWithSize1d)(olength);
+  const real *input_data = THTensor_(data)(input);
+  real *output_data = THTensor_(data)(output);
+  const int nthreads = audio_threads();
+  int failed = 0;
+  long c;
+#pragma omp parallel for num_threads(nthreads) schedule(static) \
+  if(nthreads > 1 && nchannels > 1 && length * nchannels >= AUDIO_PARALLEL_MIN)
+  for (c = 0; c < nchannels; c++) {
+    const real *in = input_data + c * cstride;
+    real *out = output_data + c;
+    resample_(state_t) rs;
+    long pos, count, done = 0, f;
+    if (!resample_(init)(&rs, k, 1, AUDIO_RESAMPLE_BLOCK)) {
+      failed = 1;
+      continue;
+    }
+    for (pos = 0; pos < length; pos += count) {
+      count = length - pos < AUDIO_RESAMPLE_BLOCK ? length - pos : AUDIO_RESAMPLE_BLOCK;
+      resample_(real_t) *buf = resample_(input)(&rs, count);
+      if (buf == NULL)
+        break;
+      for (f = 0; f < count; f++)
+        buf[f] = (resample_(real_t)) in[(pos + f) * istride];
+      resample_(commit)(&rs, count);
+      done += resample_(run)(&rs, out + done * nchannels, nchannels, 1, olength - done);
+    }
+    if (pos < length || !resample_(finish)(&rs))
+      failed = 1;
+    else
+      done += resample_(run)(&rs, out + done * nchannels, nchannels, 1, olength - done);
+    resample_(free)(&rs);
+  }
+  if (failed) {
+    THTensor_(free)(output);
+    THError("[resample] Failure to allocate the resampler");
+  }
+  return output;
+}
+
+static int audio_(Main_resample)(lua_State *L) {
+  THTensor *input = luaT_checkudata(L, 1, torch_Tensor);
+  double from = luaL_checknumber(L, 2);
+  double to = luaL_checknumber(L, 3);
+  THTensor *output = audio_(resample_generic)(input, (long)floor(from + 0.5),
+                                              (long)floor(to + 0.5));
+  luaT_pushudata(L, output, torch_Tensor);
+  return 1;
+}
+
 static const struct luaL_Reg audio_(Main__) [] = {
   {"stft", audio_(Main_stft)},
+  {"istft", audio_(Main_istft)},
+  {"spectrogram", audio_(Main_spectrogram)},
+  {"melspectrogram", audio_(Main_melspectrogram)},
+  {"mfcc", audio_(Main_mfcc)},
   {"cqt", audio_(Main_cqt)},
+  {"resample", audio_(Main_resample)},
+  {"stft_push", audio_(Main_stft_push)},
+  {"stft_flush", audio_(Main_stft_flush)},
+  {"istft_push", audio_(Main_istft_push)},
+  {"istft_flush", audio_(Main_istft_flush)},
   {NULL, NULL}
 };
 
@@ -240,4 +1168,9 @@ void audio_(Main_init)(lua_State *L)
   luaT_registeratname(L, audio_(Main__), "audio");
 }
 
+#undef fft_real
+#undef fftw_
+#undef AUDIO_FFT_SINGLE
+#undef audio_window_coef
+
 #endif
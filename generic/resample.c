@@ -0,0 +1,193 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/resample.c"
+#else
+
+// Streaming polyphase resampler (see resample.h). Float tensors are
+// filtered in single precision, every other type in double precision.
+#if defined(TH_REAL_IS_FLOAT)
+#define resample_real float
+#define resample_coef(k) ((k)->coeff)
+#else
+#define resample_real double
+#define resample_coef(k) ((k)->coef)
+#endif
+typedef resample_real resample_(real_t);
+
+// Input is pushed in blocks and kept planar, one row of cap samples per
+// channel, so every output is a contiguous dot product per channel. The
+// rows start with half - 1 zeros, the history before the first sample.
+typedef struct {
+  const audio_resample_kernel_t *k;
+  long channels;
+  resample_real *buf;
+  long cap;     // samples per row
+  long base;    // input index of the first sample held
+  long len;     // samples held per row
+  long nin;     // input samples pushed per channel
+  long n;       // next output
+  long i, p;    // its input position, i + p/up
+  long total;   // outputs in all, once finished; -1 before
+} resample_(state_t);
+
+// returns 0 if the history could not be allocated
+static int resample_(init)(resample_(state_t) *s, const audio_resample_kernel_t *k,
+                           long channels, long block)
+{
+  s->k = k;
+  s->channels = channels;
+  s->cap = block + 2 * k->taps;
+  s->buf = (resample_real *)calloc(channels * s->cap, sizeof(resample_real));
+  s->base = -(k->half - 1);
+  s->len = k->half - 1;
+  s->nin = 0;
+  s->n = s->i = s->p = 0;
+  s->total = -1;
+  return s->buf != NULL;
+}
+
+static void resample_(free)(resample_(state_t) *s)
+{
+  free(s->buf);
+  s->buf = NULL;
+}
+
+// Room for count more samples per channel: channel c goes at the returned
+// pointer + c * s->cap (read cap after the call, it may grow). History no
+// longer needed by the next output is dropped first. Returns NULL if the
+// rows could not grow.
+static resample_real *resample_(input)(resample_(state_t) *s, long count)
+{
+  long c;
+  if (s->len + count > s->cap) {
+    long drop = s->i - (s->k->half - 1) - s->base;
+    if (drop > s->len)
+      drop = s->len;
+    if (drop > 0) {
+      for (c = 0; c < s->channels; c++)
+        memmove(s->buf + c * s->cap, s->buf + c * s->cap + drop,
+                sizeof(resample_real) * (s->len - drop));
+      s->base += drop;
+      s->len -= drop;
+    }
+  }
+  if (s->len + count > s->cap) {
+    long cap = s->len + count + 2 * s->k->taps;
+    resample_real *buf = (resample_real *)malloc(sizeof(resample_real) * s->channels * cap);
+    if (buf == NULL)
+      return NULL;
+    for (c = 0; c < s->channels; c++)
+      memcpy(buf + c * cap, s->buf + c * s->cap, sizeof(resample_real) * s->len);
+    free(s->buf);
+    s->buf = buf;
+    s->cap = cap;
+  }
+  return s->buf + s->len;
+}
+
+// count samples per channel were written at resample_(input)
+static void resample_(commit)(resample_(state_t) *s, long count)
+{
+  s->len += count;
+  s->nin += count;
+}
+
+// No more input: pad with zeros so that the remaining outputs can be made.
+// Returns 0 if the rows could not grow.
+static int resample_(finish)(resample_(state_t) *s)
+{
+  const long pad = s->k->taps;
+  long c;
+  resample_real *in = resample_(input)(s, pad);
+  if (in == NULL)
+    return 0;
+  for (c = 0; c < s->channels; c++)
+    memset(in + c * s->cap, 0, sizeof(resample_real) * pad);
+  s->len += pad;
+  s->total = audio_resample_length(s->k, s->nin);
+  return 1;
+}
+
+// dot product of n (a multiple of 4) samples with n taps
+static inline double resample_(dot)(const resample_real *x, const resample_real *h, long n)
+{
+  long j;
+#if defined(TH_REAL_IS_FLOAT) && defined(__SSE2__)
+  __m128 acc = _mm_setzero_ps();
+  float t[4];
+  for (j = 0; j < n; j += 4)
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(h + j)));
+  _mm_storeu_ps(t, acc);
+  return ((double)t[0] + t[1]) + ((double)t[2] + t[3]);
+#elif !defined(TH_REAL_IS_FLOAT) && defined(__SSE2__)
+  __m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+  double t[2];
+  for (j = 0; j < n; j += 4) {
+    lo = _mm_add_pd(lo, _mm_mul_pd(_mm_loadu_pd(x + j), _mm_loadu_pd(h + j)));
+    hi = _mm_add_pd(hi, _mm_mul_pd(_mm_loadu_pd(x + j + 2), _mm_loadu_pd(h + j + 2)));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(lo, hi));
+  return t[0] + t[1];
+#else
+  double acc = 0;
+  for (j = 0; j < n; j++)
+    acc += x[j] * h[j];
+  return acc;
+#endif
+}
+
+// integer outputs are rounded and saturated
+static inline real resample_(store)(double v)
+{
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  return (real) v;
+#else
+  double lo, hi;
+#if defined(TH_REAL_IS_BYTE)
+  lo = 0; hi = 255;
+#elif defined(TH_REAL_IS_CHAR)
+  lo = -128; hi = 127;
+#elif defined(TH_REAL_IS_SHORT)
+  lo = -32768; hi = 32767;
+#elif defined(TH_REAL_IS_INT)
+  lo = -2147483648.0; hi = 2147483647.0;
+#else
+  hi = 9223372036854774784.0; // largest double below 2^63
+  lo = -hi;
+#endif
+  v = floor(v + 0.5);
+  return (real) (v < lo ? lo : v > hi ? hi : v);
+#endif
+}
+
+// Make up to max outputs from the input held so far (all of the remaining
+// ones once finished). Output m, channel c goes to out[m * fstride + c * cstride].
+// Returns the number made.
+static long resample_(run)(resample_(state_t) *s, real *out, long fstride,
+                           long cstride, long max)
+{
+  const audio_resample_kernel_t *k = s->k;
+  const long taps = k->taps, up = k->up, down = k->down;
+  const resample_real *coef = resample_coef(k);
+  long m, c;
+  for (m = 0; m < max; m++) {
+    if (s->total >= 0 && s->n >= s->total)
+      break;
+    long first = s->i - (k->half - 1);
+    if (first + taps > s->base + s->len)
+      break;
+    const resample_real *x = s->buf + (first - s->base);
+    const resample_real *h = coef + s->p * taps;
+    for (c = 0; c < s->channels; c++)
+      out[m * fstride + c * cstride] = resample_(store)(resample_(dot)(x + c * s->cap, h, taps));
+    s->n++;
+    s->p += down;
+    s->i += s->p / up;
+    s->p %= up;
+  }
+  return m;
+}
+
+#undef resample_real
+#undef resample_coef
+
+#endif
@@ -33,108 +33,773 @@
 /* --     May 24th, 2012, 8:38PM - wrote load function - Soumith Chintala */
 /* ---------------------------------------------------------------------- */
 
-void libsox_(read_audio)(sox_format_t *fd, THTensor* tensor,
-                         int* sample_rate, size_t nsamples)
+// Convert n interleaved sox samples into the destination tensor type,
+// optionally scaling them to [-1, 1) in the same pass. Short tensors get
+// the top 16 bits of each 32 bit sample, rounded and clipped as sox does.
+static void libsox_(convert)(const sox_sample_t *src, real *dst, size_t n,
+                             int normalize)
+{
+  size_t i = 0;
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  const real scale = normalize ? (real)LIBSOX_NORM : 1;
+#if defined(TH_REAL_IS_FLOAT) && defined(__SSE2__)
+  const __m128 vscale = _mm_set1_ps(scale);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), vscale));
+  }
+#elif defined(TH_REAL_IS_DOUBLE) && defined(__SSE2__)
+  const __m128d vscale = _mm_set1_pd(scale);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_cvtepi32_pd(v), vscale));
+    _mm_storeu_pd(dst + i + 2,
+                  _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0x4E)), vscale));
+  }
+#endif
+  for (; i < n; i++)
+    dst[i] = (real)src[i] * scale;
+#else
+  if (normalize)
+    THError("[read_audio] normalize is only supported for float and double tensors");
+#if defined(TH_REAL_IS_SHORT)
+#if defined(__SSE2__)
+  const __m128i vmax = _mm_set1_epi32(SOX_SAMPLE_MAX - 0x8000);
+  const __m128i vhalf = _mm_set1_epi32(0x8000);
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+    __m128i ma = _mm_cmpgt_epi32(a, vmax), mb = _mm_cmpgt_epi32(b, vmax);
+    a = _mm_or_si128(_mm_and_si128(ma, vmax), _mm_andnot_si128(ma, a));
+    b = _mm_or_si128(_mm_and_si128(mb, vmax), _mm_andnot_si128(mb, b));
+    a = _mm_srai_epi32(_mm_add_epi32(a, vhalf), 16);
+    b = _mm_srai_epi32(_mm_add_epi32(b, vhalf), 16);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+  }
+#endif
+  for (; i < n; i++)
+    dst[i] = src[i] > SOX_SAMPLE_MAX - 0x8000 ? 32767 : (real)((src[i] + 0x8000) >> 16);
+#else
+  for (; i < n; i++)
+    dst[i] = (real)src[i];
+#endif
+#endif
+}
+
+// One sample in sox units (possibly a channel average) as convert stores it
+static inline real libsox_(from_sample)(double v, int normalize)
+{
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  return (real)(normalize ? v * LIBSOX_NORM : v);
+#elif defined(TH_REAL_IS_SHORT)
+  v = floor(v / 65536 + 0.5);
+  return (real)(v > 32767 ? 32767 : v);
+#else
+  return (real)(long)floor(v + 0.5);
+#endif
+}
+
+// convert for decodes that select or mix channels: nframes frames of
+// nchannels samples become nframes frames of the output channels
+static void libsox_(convert_mapped)(const sox_sample_t *src, real *dst, size_t nframes,
+                                    long nchannels, const libsox_read_opts_t *opts)
+{
+  const long noutput = libsox_output_channels(nchannels, opts);
+  size_t f;
+  long j;
+  for (f = 0; f < nframes; f++)
+    for (j = 0; j < noutput; j++)
+      dst[f * noutput + j] = libsox_(from_sample)(libsox_mix(src + f * nchannels, nchannels,
+                                                             j, opts), opts->normalize);
+}
+
+// Where the decoders put samples: plain memory, so that decoding calls
+// nothing in TH and can run off the lua thread (see load_batch), where
+// THAlloc, the GC hook and THError's longjmp must not be reached. data
+// starts as the storage of the destination tensor when it has one, and
+// moves to malloc'ed memory the first time it has to grow. On the lua
+// thread, libsox_(buffer_finish) then makes it the tensor's contents.
+typedef struct {
+  real *data;
+  size_t capacity;   // elements data has room for
+  long rows, cols;
+  int owned;         // data was malloc'ed here
+} libsox_(buffer_t);
+
+static void libsox_(buffer_init)(libsox_(buffer_t) *b, THTensor *tensor)
+{
+  THStorage *storage = tensor ? tensor->storage : NULL;
+  memset(b, 0, sizeof(*b));
+  if (storage && storage->data && storage->size > tensor->storageOffset) {
+    b->data = storage->data + tensor->storageOffset;
+    b->capacity = storage->size - tensor->storageOffset;
+  }
+}
+
+// Returns 0, keeping the buffer as it was, when there is no memory for
+// rows x cols. Elements already stored are kept.
+static int libsox_(buffer_resize)(libsox_(buffer_t) *b, long rows, long cols)
 {
-  int nchannels = fd->signal.channels;
-  long buffer_size = fd->signal.length;
-  if (buffer_size == 0) {
-    if (nsamples != -1) {
-      buffer_size = nsamples;
+  size_t size = (size_t)rows * cols;
+  if (size > b->capacity) {
+    real *data;
+    if (b->owned) {
+      data = (real *)realloc(b->data, sizeof(real) * size);
     } else {
-      THError("[read_audio] Unknown length");
+      data = (real *)malloc(sizeof(real) * size);
+      if (data && b->rows * b->cols > 0)
+        memcpy(data, b->data, sizeof(real) * b->rows * b->cols);
     }
+    if (data == NULL)
+      return 0;
+    b->data = data;
+    b->capacity = size;
+    b->owned = 1;
   }
+  b->rows = rows;
+  b->cols = cols;
+  return 1;
+}
+
+static void libsox_(buffer_free)(libsox_(buffer_t) *b)
+{
+  if (b->owned)
+    free(b->data);
+  memset(b, 0, sizeof(*b));
+}
+
+// On the lua thread: make the buffer tensor's contents (rows x cols), or,
+// if err is set, free it and raise err.
+static void libsox_(buffer_finish)(libsox_(buffer_t) *b, THTensor *tensor, const char *err)
+{
+  if (err) {
+    libsox_(buffer_free)(b);
+    THError("%s", err);
+  }
+  if (!b->owned) {
+    // the samples are already in the tensor's storage
+    THTensor_(resize2d)(tensor, b->rows, b->cols);
+    return;
+  }
+  // the storage keeps the whole capacity, so that decoding into this
+  // tensor again (opts.out) can reuse it
+  THStorage *storage = THStorage_(newWithDataAndAllocator)(b->data, b->capacity,
+                                                           &libsox_allocator, NULL);
+  THTensor_(setStorage2d)(tensor, storage, 0, b->rows, b->cols, b->cols, 1);
+  THStorage_(free)(storage);
+  memset(b, 0, sizeof(*b));
+}
+
+// Sink at the end of an effects chain: samples are converted into the
+// buffer as they arrive, selecting or mixing channels on the way. A frame
+// split between two calls waits in frame until it is complete.
+typedef struct {
+  libsox_(buffer_t) *out;
+  const libsox_read_opts_t *opts;
+  long nchannels;    // channels leaving the chain
+  long noutput;      // channels of the output
+  size_t nframes;    // frames stored
+  size_t capacity;   // frames the buffer has room for
+  sox_sample_t *frame;
+  long held;
+  int failed;        // the buffer could not grow
+} libsox_(sink_t);
+
+static int libsox_(sink_store)(libsox_(sink_t) *s, const sox_sample_t *src, size_t nframes)
+{
+  if (s->nframes + nframes > s->capacity) {
+    while (s->nframes + nframes > s->capacity)
+      s->capacity *= 2;
+    if (!libsox_(buffer_resize)(s->out, s->capacity, s->noutput))
+      return 0;
+  }
+  real *dst = s->out->data + s->nframes * s->noutput;
+  if (libsox_mapped(s->opts))
+    libsox_(convert_mapped)(src, dst, nframes, s->nchannels, s->opts);
+  else
+    libsox_(convert)(src, dst, nframes * s->nchannels, s->opts->normalize);
+  s->nframes += nframes;
+  return 1;
+}
+
+static int libsox_(sink_flow)(sox_effect_t *effp, const sox_sample_t *ibuf,
+                              sox_sample_t *obuf, size_t *isamp, size_t *osamp)
+{
+  libsox_(sink_t) *s = *(libsox_(sink_t) **)effp->priv;
+  const size_t nchannels = s->nchannels, n = *isamp;
+  size_t i = 0;
+  (void)obuf;
+  while (i < n) {
+    if (s->held || n - i < nchannels) {
+      size_t take = nchannels - s->held;
+      if (take > n - i)
+        take = n - i;
+      memcpy(s->frame + s->held, ibuf + i, sizeof(sox_sample_t) * take);
+      s->held += take;
+      i += take;
+      if (s->held == (long)nchannels) {
+        if (!libsox_(sink_store)(s, s->frame, 1))
+          s->failed = 1;
+        s->held = 0;
+      }
+    } else {
+      size_t nframes = (n - i) / nchannels;
+      if (!libsox_(sink_store)(s, ibuf + i, nframes))
+        s->failed = 1;
+      i += nframes * nchannels;
+    }
+    if (s->failed) {
+      *osamp = 0;
+      return SOX_EOF;
+    }
+  }
+  *osamp = 0;
+  return SOX_SUCCESS;
+}
+
+static const sox_effect_handler_t libsox_(sink_handler) = {
+  "tensor", NULL, SOX_EFF_MCHAN | SOX_EFF_MODIFY,
+  NULL, NULL, libsox_(sink_flow), NULL, NULL, NULL, sizeof(void *)
+};
+
+// Run what source produces (signal, encoding) through opts->effects, and
+// libsox's rate effect when opts->rate is set, into out (nframes x
+// channels). *sample_rate is the rate that leaves the chain. Returns NULL
+// or an error, like decode.
+static const char *libsox_(run_effects)(const sox_effect_handler_t *source, void *ctx,
+                                        sox_signalinfo_t signal,
+                                        const sox_encodinginfo_t *encoding,
+                                        libsox_(buffer_t) *out, int* sample_rate,
+                                        const libsox_read_opts_t *opts)
+{
+  libsox_(sink_t) sink;
+  const char *err = NULL;
+  sox_effects_chain_t *chain = sox_create_effects_chain(encoding, encoding);
+  if (chain == NULL)
+    return "[effects] Failure to create effects chain";
+  memset(&sink, 0, sizeof(sink));
+  sox_effect_t *e = libsox_effect(source, ctx);
+  if (e == NULL || sox_add_effect(chain, e, &signal, &signal) != SOX_SUCCESS) {
+    err = "[effects] Failure to start reading";
+    libsox_effect_free(e);
+  } else {
+    free(e);
+  }
+  if (err == NULL)
+    err = libsox_add_effects(chain, &opts->effects, opts->rate, &signal);
+  if (err == NULL)
+    err = libsox_check_channels(signal.channels, opts);
+  if (err == NULL) {
+    sink.out = out;
+    sink.opts = opts;
+    sink.nchannels = signal.channels;
+    sink.noutput = libsox_output_channels(signal.channels, opts);
+    // a hint, effects that change the length do not all update it
+    sink.capacity = signal.length > 0 && signal.length != (sox_uint64_t)-1
+      ? signal.length / signal.channels + 1 : LIBSOX_BLOCK;
+    sink.frame = (sox_sample_t *)malloc(sizeof(sox_sample_t) * signal.channels);
+    e = libsox_effect(&libsox_(sink_handler), &sink);
+    if (!libsox_(buffer_resize)(out, sink.capacity, sink.noutput))
+      err = "[effects] Failure to allocate memory for the samples";
+    else if (sink.frame == NULL || e == NULL
+             || sox_add_effect(chain, e, &signal, &signal) != SOX_SUCCESS)
+      err = "[effects] Failure to start writing";
+    if (err)
+      libsox_effect_free(e);
+    else
+      free(e);
+  }
+  if (err == NULL && sox_flow_effects(chain, NULL, NULL) != SOX_SUCCESS)
+    err = sink.failed ? "[effects] Failure to allocate memory for the samples"
+      : "[effects] the effects chain failed";
+  sox_delete_effects_chain(chain);
+  free(sink.frame);
+  if (err)
+    return err;
+  if (sink.nframes == 0)
+    return "[effects] the effects chain produced no samples";
+  libsox_(buffer_resize)(out, sink.nframes, sink.noutput);
+  *sample_rate = (int)floor(signal.rate + 0.5);
+  return NULL;
+}
+
+// decode's loop when opts->rate differs from the file's rate: each block
+// is converted straight into the resampler's planar history, selecting or
+// mixing channels on the way, and resampled into the buffer, so the
+// full-rate signal is never held. capacity and limit are in input samples,
+// as in decode.
+static const char *libsox_(decode_resampled)(sox_format_t *fd, libsox_(buffer_t) *out,
+                                             size_t capacity, size_t limit,
+                                             const libsox_read_opts_t *opts)
+{
+  const long nchannels = fd->signal.channels;
+  const long noutput = libsox_output_channels(nchannels, opts);
+  const long from = (long)floor(fd->signal.rate + 0.5);
+  const char *err = audio_resample_check(from, opts->rate);
+  if (err)
+    return err;
+  const audio_resample_kernel_t *k = audio_resample_kernel(from, opts->rate);
+  long block_frames = LIBSOX_BLOCK / nchannels;
+  if (block_frames == 0)
+    return "[read_audio] too many channels to resample";
+  resample_(state_t) rs;
+  if (!resample_(init)(&rs, k, noutput, block_frames))
+    return "[read_audio] Failure to allocate the resampler";
+  // the resampler works in the units of the output
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  const double scale = opts->normalize ? LIBSOX_NORM : 1;
+#elif defined(TH_REAL_IS_SHORT)
+  const double scale = 1.0 / 65536;
+#else
+  const double scale = 1;
+#endif
+
+  long ocapacity = audio_resample_length(k, capacity / nchannels) + 1;
+  sox_sample_t *block = libsox_block();
+  if (block == NULL || !libsox_(buffer_resize)(out, ocapacity, noutput)) {
+    resample_(free)(&rs);
+    return "[read_audio] Failure to allocate memory for the samples";
+  }
+  real *out_data = out->data;
+  size_t samples_read = 0;
+  long nframes = 0, f, c;
+  int done = 0;
+  while (!done) {
+    size_t wanted = block_frames * nchannels;
+    if (wanted > limit - samples_read)
+      wanted = limit - samples_read;
+    size_t n = libsox_read_frames(fd, block, wanted);
+    if (n == 0) {
+      if (!resample_(finish)(&rs)) {
+        resample_(free)(&rs);
+        return "[read_audio] Failure to allocate the resampler";
+      }
+      done = 1;
+    } else {
+      const long count = n / nchannels;
+      resample_(real_t) *in = resample_(input)(&rs, count);
+      if (in == NULL) {
+        resample_(free)(&rs);
+        return "[read_audio] Failure to allocate the resampler";
+      }
+      if (libsox_mapped(opts)) {
+        for (c = 0; c < noutput; c++)
+          for (f = 0; f < count; f++)
+            in[c * rs.cap + f] = libsox_mix(block + f * nchannels, nchannels, c, opts) * scale;
+      } else {
+        for (c = 0; c < nchannels; c++)
+          for (f = 0; f < count; f++)
+            in[c * rs.cap + f] = block[f * nchannels + c] * scale;
+      }
+      resample_(commit)(&rs, count);
+      samples_read += n;
+    }
+    for (;;) {
+      if (nframes == ocapacity) {
+        ocapacity *= 2;
+        if (!libsox_(buffer_resize)(out, ocapacity, noutput)) {
+          resample_(free)(&rs);
+          return "[read_audio] Failure to allocate memory for the samples";
+        }
+        out_data = out->data;
+      }
+      nframes += resample_(run)(&rs, out_data + nframes * noutput, noutput, 1,
+                                ocapacity - nframes);
+      if (nframes < ocapacity)
+        break;
+    }
+  }
+  resample_(free)(&rs);
+  if (samples_read == 0)
+    return "[read_audio] Empty file, offset past the end, or read failed in sox_read";
+  libsox_(buffer_resize)(out, nframes, noutput);
+  return NULL;
+}
+
+// Decode fd into out (nframes x nchannels), starting opts->offset frames
+// in and stopping after opts->length frames when that is set.
+// Samples are read in LIBSOX_BLOCK sized pieces straight into the output
+// (through the thread's staging block for non-int tensors), so the only
+// full-size allocation is the output itself, and none at all when the
+// tensor's storage is already large enough. nsamples is a length hint used
+// when the format does not report one; the output grows if the hint is short.
+// With opts->rate set, offset and length still count frames at the file's
+// rate, and *sample_rate is opts->rate.
+// With opts->channels or opts->mono the staging block is converted into
+// just the selected (or mixed) channels, so the output never holds the
+// others. With opts->effects the samples go through an effects chain
+// instead (see run_effects); channels and mono then apply to its output
+// and opts->rate is met by libsox's rate effect.
+// Returns NULL on success or an error message. Neither decode nor what it
+// calls touches lua or TH, so it can run off the lua thread (see
+// load_batch); out becomes a tensor on the lua thread afterwards.
+static const char *libsox_(decode)(sox_format_t *fd, libsox_(buffer_t) *out,
+                                   int* sample_rate, size_t nsamples,
+                                   const libsox_read_opts_t *opts)
+{
+  size_t nchannels = fd->signal.channels;
+  size_t capacity = fd->signal.length;
+  if (capacity == 0)
+    capacity = (nsamples != (size_t)-1 && nsamples > 0) ? nsamples : LIBSOX_BLOCK * 16;
   *sample_rate = (int) fd->signal.rate;
-  int32_t *buffer = (int32_t *)malloc(sizeof(int32_t) * buffer_size);
-  size_t samples_read = sox_read(fd, buffer, buffer_size);
+  if (nchannels == 0)
+    return "[read_audio] Unknown number of channels";
+#if !defined(TH_REAL_IS_FLOAT) && !defined(TH_REAL_IS_DOUBLE)
+  if (opts->normalize)
+    return "[read_audio] normalize is only supported for float and double tensors";
+#endif
+  const char *err = libsox_check_channels(nchannels, opts);
+  if (err)
+    return err;
+  const int mapped = libsox_mapped(opts);
+  const long noutput = libsox_output_channels(nchannels, opts);
+
+  size_t skipped = libsox_skip(fd, opts->offset) * nchannels;
+  capacity = capacity > skipped ? capacity - skipped : LIBSOX_BLOCK;
+  size_t limit = opts->length ? opts->length * nchannels : (size_t)-1;
+  if (capacity > limit)
+    capacity = limit;
+  capacity = ((capacity + nchannels - 1) / nchannels) * nchannels;
+
+  if (opts->effects.n) {
+    libsox_fd_source_t source = {fd, limit};
+    sox_signalinfo_t signal = fd->signal;
+    if (signal.length && signal.length != (sox_uint64_t)-1) {
+      signal.length = signal.length > skipped ? signal.length - skipped : 0;
+      if (signal.length > limit)
+        signal.length = limit;
+    }
+    return libsox_(run_effects)(&libsox_fd_source, &source, signal, &fd->encoding,
+                                out, sample_rate, opts);
+  }
+
+  if (opts->rate && opts->rate != *sample_rate) {
+    *sample_rate = (int) opts->rate;
+    return libsox_(decode_resampled)(fd, out, capacity, limit, opts);
+  }
+
+  sox_sample_t *block = libsox_block();
+  if (block == NULL || !libsox_(buffer_resize)(out, capacity / nchannels, noutput))
+    return "[read_audio] Failure to allocate memory for the samples";
+  real *out_data = out->data;
+  // mapped reads take whole frames, so that each block converts on its own
+  const size_t block_size = mapped ? (LIBSOX_BLOCK / nchannels) * nchannels : LIBSOX_BLOCK;
+  size_t samples_read = 0;
+  while (samples_read < limit) {
+    // once the output is full, read into the staging block and grow only if
+    // that read returns samples: a length reported by the format fills the
+    // output exactly, and the read that finds the end costs no reallocation
+    const int full = samples_read == capacity;
+    size_t wanted = limit - samples_read;
+    if (!full && wanted > capacity - samples_read)
+      wanted = capacity - samples_read;
+    if (wanted > block_size)
+      wanted = block_size;
+    size_t n;
+    if (mapped)
+      n = libsox_read_frames(fd, block, wanted);
+#ifdef TH_REAL_IS_INT
+    else if (!full)
+      n = sox_read(fd, (sox_sample_t *)out_data + samples_read, wanted);
+#endif
+    else
+      n = sox_read(fd, block, wanted);
+    if (n == 0)
+      break;
+    if (full) {
+      while (capacity < samples_read + n)
+        capacity *= 2;
+      if (capacity > limit)
+        capacity = limit;
+      if (!libsox_(buffer_resize)(out, capacity / nchannels, noutput))
+        return "[read_audio] Failure to allocate memory for the samples";
+      out_data = out->data;
+    }
+    if (mapped) {
+      libsox_(convert_mapped)(block, out_data + (samples_read / nchannels) * noutput,
+                              n / nchannels, nchannels, opts);
+    } else {
+#ifdef TH_REAL_IS_INT
+      if (full)
+        memcpy((sox_sample_t *)out_data + samples_read, block, sizeof(sox_sample_t) * n);
+#else
+      libsox_(convert)(block, out_data + samples_read, n, opts->normalize);
+#endif
+    }
+    samples_read += n;
+  }
   if (samples_read == 0)
-    THError("[read_audio] Empty file or read failed in sox_read");
-  // alloc tensor
-  THTensor_(resize2d)(tensor, samples_read / nchannels, nchannels );
-  real *tensor_data = THTensor_(data)(tensor);
-  // convert audio to dest tensor
-  int x,k;
-  for (x=0; x<samples_read/nchannels; x++) {
-    for (k=0; k<nchannels; k++) {
-      *tensor_data++ = (real)buffer[x*nchannels+k];
+    return "[read_audio] Empty file, offset past the end, or read failed in sox_read";
+  // shrink to what was actually decoded
+  libsox_(buffer_resize)(out, samples_read / nchannels, noutput);
+  return NULL;
+}
+
+// decode for a WAV file mapped at m: the window is converted block by block
+// straight from the mapping, through the same conversions as decode, so
+// only its pages are read and the results are identical.
+static const char *libsox_(decode_wav)(const libsox_map_t *m, const libsox_wav_t *w,
+                                       libsox_(buffer_t) *out, int* sample_rate,
+                                       const libsox_read_opts_t *opts)
+{
+  const long nchannels = w->channels;
+  *sample_rate = (int) w->rate;
+#if !defined(TH_REAL_IS_FLOAT) && !defined(TH_REAL_IS_DOUBLE)
+  if (opts->normalize)
+    return "[read_audio] normalize is only supported for float and double tensors";
+#endif
+  const char *err = libsox_check_channels(nchannels, opts);
+  if (err)
+    return err;
+  const int mapped = libsox_mapped(opts);
+  const long noutput = libsox_output_channels(nchannels, opts);
+
+  size_t first = opts->offset < w->nframes ? opts->offset : w->nframes;
+  size_t count = w->nframes - first;
+  if (opts->length && opts->length < count)
+    count = opts->length;
+  if (count == 0)
+    return "[read_audio] Empty file, offset past the end, or read failed in sox_read";
+  const size_t stride = nchannels * w->bytes;
+  const unsigned char *src = m->base + w->data + first * stride;
+  libsox_map_advise(m, src, count * stride);
+
+  sox_sample_t *block = libsox_block();
+  if (block == NULL || !libsox_(buffer_resize)(out, count, noutput))
+    return "[read_audio] Failure to allocate memory for the samples";
+  real *out_data = out->data;
+  const size_t block_frames = LIBSOX_BLOCK / nchannels;
+  size_t f, n;
+  for (f = 0; f < count; f += n) {
+    n = count - f < block_frames ? count - f : block_frames;
+    if (mapped) {
+      libsox_wav_samples(src + f * stride, w->bytes, n * nchannels, block);
+      libsox_(convert_mapped)(block, out_data + f * noutput, n, nchannels, opts);
+    } else {
+#ifdef TH_REAL_IS_INT
+      libsox_wav_samples(src + f * stride, w->bytes, n * nchannels,
+                         (sox_sample_t *)out_data + f * nchannels);
+#else
+      libsox_wav_samples(src + f * stride, w->bytes, n * nchannels, block);
+      libsox_(convert)(block, out_data + f * nchannels, n * nchannels, opts->normalize);
+#endif
     }
   }
-  // free buffer and sox structures
-  free(buffer);
+  return NULL;
 }
 
-void libsox_(read_audio_file)(const char *file_name, THTensor* tensor, int* sample_rate)
+// PCM WAV files are read from a mapping (see libsox_wav_parse), unless they
+// have to be resampled or go through effects; everything else is decoded
+// by libsox.
+static const char *libsox_(decode_file)(const char *file_name, libsox_(buffer_t) *out,
+                                        int* sample_rate,
+                                        const libsox_read_opts_t *opts)
 {
-  // Create sox objects and read into int32_t buffer
-  sox_format_t *fd;
-  fd = sox_open_read(file_name, NULL, NULL, NULL);
+  libsox_map_t m;
+  libsox_wav_t w;
+  if (libsox_map(file_name, &m)) {
+    if (libsox_wav_parse(&m, &w) && w.channels <= LIBSOX_BLOCK && opts->effects.n == 0
+        && (opts->rate == 0 || opts->rate == w.rate)) {
+      const char *err = libsox_(decode_wav)(&m, &w, out, sample_rate, opts);
+      libsox_unmap(&m);
+      return err;
+    }
+    libsox_unmap(&m);
+  }
+  sox_format_t *fd = sox_open_read(file_name, NULL, NULL, NULL);
   if (fd == NULL)
-    THError("[read_audio_file] Failure to read file");
-  libsox_(read_audio)(fd, tensor, sample_rate, -1);
+    return "[read_audio_file] Failure to read file";
+  const char *err = libsox_(decode)(fd, out, sample_rate, -1, opts);
   sox_close(fd);
+  return err;
 }
 
-void libsox_(read_audio_memory)(THCharTensor *inp, THTensor* tensor,
-                                int* sample_rate, const char* extension)
+// buffer holds encoded bytes: the output of compress, or a file of the
+// given format from anywhere else. Blobs from older versions of compress
+// start with a sample count (see libsox_legacy_prefix), which is skipped
+// and used as the length hint. libsox reads the bytes where they are.
+static const char *libsox_(decode_memory)(char *buffer, size_t buffer_size,
+                                          libsox_(buffer_t) *out, int* sample_rate,
+                                          const char* extension,
+                                          const libsox_read_opts_t *opts)
 {
-  // Create sox objects and read into int32_t buffer
-  sox_format_t *fd;
-  char* buffer = THCharTensor_data(inp);
-  size_t buffer_size = THCharTensor_size(inp, 0);
-  int64_t length;
-  memcpy(&length, buffer, 8);
-  fd = sox_open_mem_read(buffer + 8, buffer_size, NULL, NULL, extension);
+  int64_t length = -1;
+  size_t skip = libsox_legacy_prefix((const unsigned char *)buffer, buffer_size, extension,
+                                     opts->legacy, &length);
+  if (buffer_size <= skip)
+    return "[read_audio_memory] Input buffer too small";
+  sox_format_t *fd = sox_open_mem_read(buffer + skip, buffer_size - skip, NULL, NULL, extension);
   if (fd == NULL)
-    THError("[read_audio_memory] Failure to read input buffer");
-  libsox_(read_audio)(fd, tensor, sample_rate, length);
+    return "[read_audio_memory] Failure to read input buffer";
+  const char *err = libsox_(decode)(fd, out, sample_rate, (size_t)length, opts);
   sox_close(fd);
+  return err;
+}
+
+void libsox_(read_audio)(sox_format_t *fd, THTensor* tensor,
+                         int* sample_rate, size_t nsamples,
+                         const libsox_read_opts_t *opts)
+{
+  libsox_(buffer_t) out;
+  libsox_(buffer_init)(&out, tensor);
+  const char *err = libsox_(decode)(fd, &out, sample_rate, nsamples, opts);
+  libsox_(buffer_finish)(&out, tensor, err);
+}
+
+void libsox_(read_audio_file)(const char *file_name, THTensor* tensor, int* sample_rate,
+                              const libsox_read_opts_t *opts)
+{
+  libsox_(buffer_t) out;
+  libsox_(buffer_init)(&out, tensor);
+  const char *err = libsox_(decode_file)(file_name, &out, sample_rate, opts);
+  libsox_(buffer_finish)(&out, tensor, err);
+}
+
+void libsox_(read_audio_memory)(THCharTensor *inp, THTensor* tensor,
+                                int* sample_rate, const char* extension,
+                                const libsox_read_opts_t *opts)
+{
+  libsox_(buffer_t) out;
+  libsox_(buffer_init)(&out, tensor);
+  const char *err = libsox_(decode_memory)(THCharTensor_data(inp),
+                                           THCharTensor_nElement(inp),
+                                           &out, sample_rate, extension, opts);
+  libsox_(buffer_finish)(&out, tensor, err);
+}
+
+// Convert n contiguous samples to sox_sample_t with saturation. Float and
+// double inputs are rounded to nearest, optionally rescaled from [-1, 1) and
+// optionally TPDF-dithered at the output bit depth. Short inputs are 16 bit
+// samples, the inverse of load.
+static void libsox_(quantize)(const real *src, sox_sample_t *dst, size_t n,
+                              const libsox_write_opts_t *opts, uint32_t *seed)
+{
+  size_t i = 0;
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  const double scale = opts->normalized ? (double)SOX_SAMPLE_MAX + 1.0 : 1.0;
+  if (opts->dither) {
+    const double lsb = ldexp(1.0, 32 - (opts->bits ? opts->bits : 16));
+    for (; i < n; i++) {
+      double noise = libsox_uniform(seed) + libsox_uniform(seed) - 1.0;
+      dst[i] = libsox_saturate(src[i] * scale + noise * lsb);
+    }
+    return;
+  }
+#if defined(TH_REAL_IS_FLOAT) && defined(__SSE2__)
+  const __m128 vscale = _mm_set1_ps((float)scale);
+  const __m128 vmax = _mm_set1_ps(2147483520.f); // largest float below 2^31
+  const __m128 vmin = _mm_set1_ps(-2147483648.f);
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), vscale);
+    v = _mm_min_ps(_mm_max_ps(v, vmin), vmax);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_cvtps_epi32(v));
+  }
+#elif defined(TH_REAL_IS_DOUBLE) && defined(__SSE2__)
+  const __m128d vscale = _mm_set1_pd(scale);
+  const __m128d vmax = _mm_set1_pd((double)SOX_SAMPLE_MAX);
+  const __m128d vmin = _mm_set1_pd((double)SOX_SAMPLE_MIN);
+  for (; i + 4 <= n; i += 4) {
+    __m128d lo = _mm_mul_pd(_mm_loadu_pd(src + i), vscale);
+    __m128d hi = _mm_mul_pd(_mm_loadu_pd(src + i + 2), vscale);
+    lo = _mm_min_pd(_mm_max_pd(lo, vmin), vmax);
+    hi = _mm_min_pd(_mm_max_pd(hi, vmin), vmax);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_unpacklo_epi64(_mm_cvtpd_epi32(lo), _mm_cvtpd_epi32(hi)));
+  }
+#endif
+  for (; i < n; i++)
+    dst[i] = libsox_saturate(src[i] * scale);
+#else
+#if defined(TH_REAL_IS_SHORT)
+  // 16 bit samples, as load gives them, fill the top of a sox sample
+  for (; i < n; i++)
+    dst[i] = (sox_sample_t)((uint32_t)(int32_t)src[i] << 16);
+#else
+  for (; i < n; i++)
+    dst[i] = (sox_sample_t)src[i];
+#endif
+#endif
+}
+
+// Raise for what write_audio cannot encode, before anything is opened or
+// allocated
+static void libsox_(check_write)(THTensor* src, const libsox_write_opts_t *opts)
+{
+#if !defined(TH_REAL_IS_FLOAT) && !defined(TH_REAL_IS_DOUBLE)
+  if (opts->normalized || opts->dither)
+    THError("[write_audio] normalized and dither need float or double tensors");
+#endif
+  if (THTensor_(nDimension)(src) < 1 || THTensor_(nDimension)(src) > 2)
+    THError("[write_audio] Input should be a 1D or 2D tensor");
+  if (THTensor_(nDimension)(src) > 1 && src->size[1] == 0)
+    THError("[write_audio] Input has no channels");
 }
 
+// Write src (nsamples x nchannels, or a 1D mono tensor) to fd in blocks of
+// about LIBSOX_BLOCK samples. Non-contiguous tensors are gathered one block
+// at a time, so the caller never needs a full copy.
 void libsox_(write_audio)(sox_format_t *fd, THTensor* src,
-			  const char *extension, int sample_rate)
+                          const libsox_write_opts_t *opts)
 {
-  long nchannels = src->size[1];
   long nsamples = src->size[0];
-  real* data = THTensor_(data)(src);
-
-  // convert audio to dest tensor
-  int x,k;
-  for (x=0; x<nsamples; x++) {
-    for (k=0; k<nchannels; k++) {
-      int32_t sample = (int32_t)(data[x*nchannels+k]);
-      size_t samples_written = sox_write(fd, &sample, 1);
-      if (samples_written != 1)
-	THError("[write_audio_file] write failed in sox_write");
+  long nchannels = THTensor_(nDimension)(src) > 1 ? src->size[1] : 1;
+  long sstride = src->stride[0];
+  long cstride = THTensor_(nDimension)(src) > 1 ? src->stride[1] : 1;
+  int contiguous = (cstride == 1 && (sstride == nchannels || nsamples == 1));
+  real *data = THTensor_(data)(src);
+
+  long block_frames = LIBSOX_BLOCK / nchannels;
+  if (block_frames == 0)
+    block_frames = 1;
+  sox_sample_t *block = (sox_sample_t *)malloc(sizeof(sox_sample_t)
+                                               * block_frames * nchannels);
+  real *gather = contiguous ? NULL
+    : (real *)malloc(sizeof(real) * block_frames * nchannels);
+  uint32_t seed = 0x9E3779B9;
+
+  long x, k;
+  for (x = 0; x < nsamples; x += block_frames) {
+    long nframes = nsamples - x < block_frames ? nsamples - x : block_frames;
+    size_t n = nframes * nchannels;
+    const real *in = data + x * nchannels;
+    if (!contiguous) {
+      long f;
+      for (f = 0; f < nframes; f++)
+        for (k = 0; k < nchannels; k++)
+          gather[f * nchannels + k] = data[(x + f) * sstride + k * cstride];
+      in = gather;
+    }
+    libsox_(quantize)(in, block, n, opts, &seed);
+    if (sox_write(fd, block, n) != n) {
+      free(block);
+      free(gather);
+      THError("[write_audio] write failed in sox_write");
     }
   }
+  free(block);
+  free(gather);
 }
 
 void libsox_(write_audio_file)(const char *file_name, THTensor* src,
-			       const char *extension, int sample_rate)
+                               const char *extension, int sample_rate,
+                               const libsox_write_opts_t *opts)
 {
-  if (THTensor_(isContiguous)(src) == 0)
-    THError("[write_audio_file] Input should be contiguous tensors");
-
-  long nchannels = src->size[1];
+  long nchannels = THTensor_(nDimension)(src) > 1 ? src->size[1] : 1;
   long nsamples = src->size[0];
 
   sox_format_t *fd;
 
   // Create sox objects and write into int32_t buffer
   sox_signalinfo_t sinfo;
-  sinfo.rate = sample_rate;
-  sinfo.channels = nchannels;
-  sinfo.length = nsamples * nchannels;
-  sinfo.precision = sizeof(int32_t) * 8; /* precision in bits */
-#if SOX_LIB_VERSION_CODE >= 918272 // >= 14.3.0
-  sinfo.mult = NULL;
-#endif
-  fd = sox_open_write(file_name, &sinfo, NULL, extension, NULL, NULL);
+  sox_encodinginfo_t einfo;
+  libsox_(check_write)(src, opts);
+  sox_encodinginfo_t *encoding = libsox_write_info(&sinfo, &einfo, sample_rate,
+                                                   nchannels, nsamples, opts);
+  fd = sox_open_write(file_name, &sinfo, encoding, extension, NULL, NULL);
   if (fd == NULL)
     THError("[write_audio_file] Failure to open file for writing");
 
-  libsox_(write_audio)(fd, src, extension, sample_rate);
+  libsox_(write_audio)(fd, src, opts);
 
   // free buffer and sox structures
   sox_close(fd);
@@ -142,66 +807,130 @@ void libsox_(write_audio_file)(const char *file_name, THTensor* src,
   return;
 }
 
-void libsox_(write_audio_memory)(THCharTensor* out, THTensor* src,
-				 const char *extension, int sample_rate)
+// Encode src in memory. *buffer is malloc'ed by libsox, the caller frees it.
+static void libsox_(encode_memory)(THTensor* src, const char *extension, int sample_rate,
+                                   const libsox_write_opts_t *opts,
+                                   char **buffer, size_t *buffer_size)
 {
-  if (THTensor_(isContiguous)(src) == 0)
-    THError("[write_audio_file] Input should be contiguous tensors");
-
-  long nchannels = src->size[1];
+  long nchannels = THTensor_(nDimension)(src) > 1 ? src->size[1] : 1;
   long nsamples = src->size[0];
 
   sox_format_t *fd;
-  char *buffer = NULL;
-  size_t buffer_size = -1;
+  *buffer = NULL;
+  *buffer_size = -1;
 
   // Create sox objects and write into int32_t buffer
   sox_signalinfo_t sinfo;
-  sinfo.rate = sample_rate;
-  sinfo.channels = nchannels;
-  sinfo.length = nsamples * nchannels;
-  sinfo.precision = sizeof(int32_t) * 8; /* precision in bits */
-#if SOX_LIB_VERSION_CODE >= 918272 // >= 14.3.0
-  sinfo.mult = NULL;
-#endif
-  fd = sox_open_memstream_write(&buffer, &buffer_size, &sinfo, NULL, extension, NULL);
+  sox_encodinginfo_t einfo;
+  libsox_(check_write)(src, opts);
+  sox_encodinginfo_t *encoding = libsox_write_info(&sinfo, &einfo, sample_rate,
+                                                   nchannels, nsamples, opts);
+  fd = sox_open_memstream_write(buffer, buffer_size, &sinfo, encoding, extension, NULL);
   if (fd == NULL)
     THError("[write_audio_memory] Failure to open sox object for writing");
 
-  libsox_(write_audio)(fd, src, extension, sample_rate);
+  libsox_(write_audio)(fd, src, opts);
 
   // free sox structures
   sox_close(fd);
+}
 
-  // write the number of samples as well. to get around a SOX bug for certain formats.
-  int64_t olength = nsamples * nchannels;
-  size_t  out_size = buffer_size + 8;
-  char *  out_data = (char*) malloc(out_size);
-
-  /* TODO: investigate why if I create a storage and memcpy over, it's segfaulting */
-  // THCharStorage* out_storage = THCharStorage_newWithSize1(out_size);
-  // char* out_data = THCharStorage_data(out_storage);
+// The encoder's buffer becomes the storage of out as it is, without a copy
+void libsox_(write_audio_memory)(THCharTensor* out, THTensor* src,
+                                 const char *extension, int sample_rate,
+                                 const libsox_write_opts_t *opts)
+{
+  char *buffer;
+  size_t buffer_size;
 
-  // write the actual data after an offset of int64_t
-  memcpy(out_data + 8, buffer, buffer_size);
-  memcpy(out_data, &olength, 8);
+  libsox_(encode_memory)(src, extension, sample_rate, opts, &buffer, &buffer_size);
 
-  THCharStorage* out_storage = THCharStorage_newWithData(out_data, out_size);
+  // the memstream's buffer came from malloc: it goes back to free, not THFree
+  THCharStorage* out_storage = THCharStorage_newWithDataAndAllocator(buffer, buffer_size,
+                                                                     &libsox_allocator, NULL);
+  THCharTensor_setStorage1d(out, out_storage, 0, buffer_size, 1);
+  THCharStorage_free(out_storage);
+}
 
-  THCharTensor_setStorage1d(out, out_storage, 0, out_size, 1);
+// opts.out, if the options table at idx has one. It is resized to the
+// decoded length, which only reallocates its storage when it has to grow.
+static THTensor *libsox_(check_out)(lua_State *L, int idx)
+{
+  THTensor *out = NULL;
+  if (!lua_istable(L, idx))
+    return NULL;
+  lua_getfield(L, idx, "out");
+  if (!lua_isnil(L, -1)) {
+    out = luaT_toudata(L, -1, torch_Tensor);
+    if (out == NULL)
+      luaL_error(L, "opts.out should be a %s", torch_Tensor);
+    if (!THTensor_(isContiguous)(out))
+      luaL_error(L, "opts.out should be contiguous");
+  }
+  lua_pop(L, 1);
+  return out;
+}
 
-  // free buffers and stuff
-  free(buffer);
+// push the decoded tensor: opts.out itself when it was given
+static void libsox_(push_output)(lua_State *L, THTensor *tensor, THTensor *out, int idx)
+{
+  if (out)
+    lua_getfield(L, idx, "out");
+  else
+    luaT_pushudata(L, tensor, torch_Tensor);
+}
 
-  return;
+#if defined(TH_REAL_IS_SHORT)
+// Load a 16 bit PCM WAV file without decoding it at all: the tensor is a
+// view of a private (copy on write) mapping of the whole file, so pages are
+// only read when the samples on them are used and writing to the tensor
+// never touches the file. Only for plain loads into a new tensor on a
+// little-endian host; returns 0 when the file has to be decoded instead.
+static int libsox_(load_mapped)(const char *file_name, THTensor *tensor, int *sample_rate,
+                                const libsox_read_opts_t *opts)
+{
+  const uint16_t one = 1;
+  libsox_map_t m;
+  libsox_wav_t w;
+  int ok;
+  if (*(const unsigned char *)&one != 1 || libsox_mapped(opts) || opts->normalize
+      || opts->effects.n)
+    return 0;
+  if (!libsox_map(file_name, &m))
+    return 0;
+  ok = libsox_wav_parse(&m, &w) && w.bytes == 2 && w.data % 2 == 0
+    && opts->offset < w.nframes && (opts->rate == 0 || opts->rate == w.rate);
+  libsox_unmap(&m);
+  if (!ok)
+    return 0;
+  size_t count = w.nframes - opts->offset;
+  if (opts->length && opts->length < count)
+    count = opts->length;
+  THShortStorage *storage = THShortStorage_newWithMapping(file_name, 0, 0);
+  THShortTensor_setStorage2d(tensor, storage, (w.data / 2) + opts->offset * w.channels,
+                             count, w.channels, w.channels, 1);
+  THShortStorage_free(storage);
+  *sample_rate = (int) w.rate;
+  return 1;
 }
+#endif
 
 static int libsox_(Main_load)(lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
-  THTensor *tensor = THTensor_(new)();
+  libsox_read_opts_t opts;
+  libsox_check_read_opts(L, 2, &opts);
+  THTensor *out = libsox_(check_out)(L, 2);
+  THTensor *tensor = out ? out : THTensor_(new)();
   int sample_rate = 0;
-  libsox_(read_audio_file)(filename, tensor, &sample_rate);
-  luaT_pushudata(L, tensor, torch_Tensor);
+#if defined(TH_REAL_IS_SHORT)
+  if (out == NULL && libsox_(load_mapped)(filename, tensor, &sample_rate, &opts)) {
+    luaT_pushudata(L, tensor, torch_Tensor);
+    lua_pushnumber(L, (double) sample_rate);
+    return 2;
+  }
+#endif
+  libsox_(read_audio_file)(filename, tensor, &sample_rate, &opts);
+  libsox_(push_output)(L, tensor, out, 2);
   lua_pushnumber(L, (double) sample_rate);
   return 2;
 }
@@ -209,20 +938,185 @@ static int libsox_(Main_load)(lua_State *L) {
 static int libsox_(Main_decompress)(lua_State *L) {
   THCharTensor *inp = luaT_checkudata(L, 1, "torch.CharTensor");
   const char *extension = luaL_checkstring(L, 2);
-  THTensor *tensor = THTensor_(new)();
+  libsox_read_opts_t opts;
+  libsox_check_read_opts(L, 3, &opts);
+  THTensor *out = libsox_(check_out)(L, 3);
+  THTensor *tensor = out ? out : THTensor_(new)();
   int sample_rate = 0;
-  libsox_(read_audio_memory)(inp, tensor, &sample_rate, extension);
-  luaT_pushudata(L, tensor, torch_Tensor);
+  libsox_(read_audio_memory)(inp, tensor, &sample_rate, extension, &opts);
+  libsox_(push_output)(L, tensor, out, 3);
   lua_pushnumber(L, (double) sample_rate);
   return 2;
 }
 
+// What the workers of a load_batch call share: each one decodes item i
+// into outs[i], and touches nothing else.
+typedef struct {
+  libsox_batch_item_t *items;
+  libsox_(buffer_t) *outs;
+  const libsox_read_opts_t *opts;
+  const char *extension;
+} libsox_(batch_t);
+
+static void libsox_(batch_work)(void *ctx, long i)
+{
+  libsox_(batch_t) *batch = (libsox_(batch_t) *)ctx;
+  libsox_batch_item_t *item = &batch->items[i];
+  const char *err;
+  if (item->filename)
+    err = libsox_(decode_file)(item->filename, &batch->outs[i], &item->sample_rate,
+                               batch->opts);
+  else
+    err = libsox_(decode_memory)(item->data, item->size, &batch->outs[i],
+                                 &item->sample_rate, batch->extension, batch->opts);
+  if (err) {
+    snprintf(item->err, sizeof(item->err), "%s", err);
+    libsox_(buffer_free)(&batch->outs[i]);
+  }
+}
+
+// arguments [table of filenames or CharTensors, number of threads, options]
+// options are those of load, plus extension (needed for CharTensor items)
+// and pad.
+// returns [table of tensors (false where decoding failed), table of sample
+// rates, table of error messages indexed like the input]
+// or, with pad = true,
+// [batch x max-frames x max-channels zero-padded tensor, LongTensor of
+// lengths, sample rates, error messages]
+static int libsox_(Main_load_batch)(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int nthreads = luaL_optint(L, 2, 0);
+  libsox_read_opts_t opts;
+  libsox_check_read_opts(L, 3, &opts);
+  const char *extension = NULL;
+  int pad = 0;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "extension");
+    extension = lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL;
+    lua_getfield(L, 3, "pad");
+    pad = lua_toboolean(L, -1);
+    lua_pop(L, 2); // extension stays referenced by the options table
+  }
+
+  long n = lua_objlen(L, 1), i;
+  libsox_batch_item_t *items = calloc(n > 0 ? n : 1, sizeof(libsox_batch_item_t));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      items[i].filename = lua_tostring(L, -1);
+    } else {
+      THCharTensor *blob = luaT_toudata(L, -1, "torch.CharTensor");
+      if (blob == NULL || extension == NULL) {
+        free(items);
+        luaL_error(L, "[load_batch] item %d should be a filename, or a CharTensor "
+                   "with options.extension set", (int)(i + 1));
+      }
+      items[i].data = THCharTensor_data(blob);
+      items[i].size = THCharTensor_nElement(blob);
+    }
+    lua_pop(L, 1);
+  }
+  // items are decoded into plain buffers, which only become tensors after
+  // the workers are done
+  libsox_(buffer_t) *outs = calloc(n > 0 ? n : 1, sizeof(libsox_(buffer_t)));
+
+  // each item opens and closes its own sox_format_t, so workers share nothing
+  libsox_(batch_t) work = {items, outs, &opts, extension};
+  libsox_pool_run(n, nthreads, libsox_(batch_work), &work);
+
+  int nret = 0;
+  if (pad) {
+    long maxframes = 0, maxchannels = 0;
+    for (i = 0; i < n; i++) {
+      if (outs[i].rows > maxframes)
+        maxframes = outs[i].rows;
+      if (outs[i].cols > maxchannels)
+        maxchannels = outs[i].cols;
+    }
+    THTensor *batch = THTensor_(newWithSize3d)(n, maxframes, maxchannels);
+    THLongTensor *lengths = THLongTensor_newWithSize1d(n);
+    THTensor_(zero)(batch);
+    real *batch_data = THTensor_(data)(batch);
+    long *lengths_data = THLongTensor_data(lengths);
+    for (i = 0; i < n; i++) {
+      real *dst = batch_data + i * maxframes * maxchannels;
+      long nframes = outs[i].rows, nchannels = outs[i].cols, x;
+      const real *src = outs[i].data;
+      lengths_data[i] = nframes;
+      if (nframes == 0)
+        continue;
+      if (nchannels == maxchannels) {
+        memcpy(dst, src, sizeof(real) * nframes * nchannels);
+      } else {
+        for (x = 0; x < nframes; x++)
+          memcpy(dst + x * maxchannels, src + x * nchannels, sizeof(real) * nchannels);
+      }
+    }
+    luaT_pushudata(L, batch, torch_Tensor);
+    luaT_pushudata(L, lengths, "torch.LongTensor");
+    nret = 2;
+  } else {
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+      if (items[i].err[0]) {
+        lua_pushboolean(L, 0);
+      } else {
+        THTensor *tensor = THTensor_(new)();
+        libsox_(buffer_finish)(&outs[i], tensor, NULL);
+        luaT_pushudata(L, tensor, torch_Tensor);
+      }
+      lua_rawseti(L, -2, i + 1);
+    }
+    nret = 1;
+  }
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushnumber(L, (double) items[i].sample_rate);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_createtable(L, 0, 0);
+  for (i = 0; i < n; i++) {
+    if (items[i].err[0]) {
+      lua_pushstring(L, items[i].err);
+      lua_rawseti(L, -2, i + 1);
+    }
+  }
+  for (i = 0; i < n; i++)
+    libsox_(buffer_free)(&outs[i]);
+  free(outs);
+  free(items);
+  return nret + 2;
+}
+
+// arguments [stream-handle, tensor]
+// returns [number of frames read into tensor, 0 at the end of the stream]
+static int libsox_(Main_stream_read)(lua_State *L) {
+  libsox_stream_t *s = libsox_checkstream(L, 1);
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  size_t nframes = libsox_stream_fill(s);
+  if (nframes > 0) {
+    long nchannels = s->fd->signal.channels;
+    THTensor_(resize2d)(tensor, nframes, libsox_output_channels(nchannels, &s->opts));
+    if (libsox_mapped(&s->opts))
+      libsox_(convert_mapped)(s->buffer, THTensor_(data)(tensor), nframes, nchannels,
+                              &s->opts);
+    else
+      libsox_(convert)(s->buffer, THTensor_(data)(tensor), nframes * nchannels,
+                       s->opts.normalize);
+  }
+  lua_pushnumber(L, (double) nframes);
+  return 1;
+}
+
 static int libsox_(Main_save)(lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
   THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
   const char *extension = luaL_checkstring(L, 3);
   int sample_rate = luaL_checkint(L, 4);
-  libsox_(write_audio_file)(filename, tensor, extension, sample_rate);
+  libsox_write_opts_t opts;
+  libsox_check_write_opts(L, 5, &opts);
+  libsox_(write_audio_file)(filename, tensor, extension, sample_rate, &opts);
   return 1;
 }
 
@@ -231,7 +1125,154 @@ static int libsox_(Main_compress)(lua_State *L) {
   THTensor *src = luaT_checkudata(L, 2, torch_Tensor);
   const char *extension = luaL_checkstring(L, 3);
   int sample_rate = luaL_checkint(L, 4);
-  libsox_(write_audio_memory)(out, src, extension, sample_rate);
+  libsox_write_opts_t opts;
+  libsox_check_write_opts(L, 5, &opts);
+  libsox_(write_audio_memory)(out, src, extension, sample_rate, &opts);
+  return 1;
+}
+
+// Source for an effects chain that quantizes a contiguous tensor, as save
+// would write it
+typedef struct {
+  const real *data;
+  size_t pos, total;    // in samples
+  long nchannels;
+  libsox_write_opts_t wopts;
+  uint32_t seed;
+} libsox_(tensor_source_t);
+
+static int libsox_(tensor_source_drain)(sox_effect_t *effp, sox_sample_t *obuf, size_t *osamp)
+{
+  libsox_(tensor_source_t) *s = *(libsox_(tensor_source_t) **)effp->priv;
+  size_t n = *osamp - *osamp % s->nchannels;
+  if (n > s->total - s->pos)
+    n = s->total - s->pos;
+  libsox_(quantize)(s->data + s->pos, obuf, n, &s->wopts, &s->seed);
+  s->pos += n;
+  *osamp = n;
+  return n ? SOX_SUCCESS : SOX_EOF;
+}
+
+static const sox_effect_handler_t libsox_(tensor_source) = {
+  "tensor", NULL, SOX_EFF_MCHAN | SOX_EFF_MODIFY,
+  NULL, NULL, NULL, libsox_(tensor_source_drain), NULL, NULL, sizeof(void *)
+};
+
+// arguments [tensor, sample_rate, effects, options]
+// returns [tensor, sample_rate]. The input is read as save reads it and the
+// output made as load makes it: normalize applies to both, and offset,
+// length, channels, mono, rate and out work as they do for load.
+static int libsox_(Main_apply_effects)(lua_State *L) {
+  THTensor *src = luaT_checkudata(L, 1, torch_Tensor);
+  int sample_rate = luaL_checkint(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  libsox_read_opts_t opts;
+  libsox_check_read_opts(L, 4, &opts);
+  libsox_check_effects(L, 3, &opts.effects);
+  THTensor *out = libsox_(check_out)(L, 4);
+  int ndim = THTensor_(nDimension)(src);
+  if (ndim != 1 && ndim != 2)
+    luaL_error(L, "[apply_effects] input should be NSamples or NSamples x NChannels");
+  if (ndim == 2 && src->size[1] == 0)
+    luaL_error(L, "[apply_effects] input has no channels");
+  if (out && out->storage == src->storage)
+    luaL_error(L, "opts.out should not share storage with the input");
+#if !defined(TH_REAL_IS_FLOAT) && !defined(TH_REAL_IS_DOUBLE)
+  if (opts.normalize)
+    luaL_error(L, "[apply_effects] normalize is only supported for float and double tensors");
+#endif
+  THTensor *input = THTensor_(newContiguous)(src);
+  long nchannels = ndim > 1 ? input->size[1] : 1;
+  size_t nframes = input->size[0];
+  size_t first = opts.offset < nframes ? opts.offset : nframes;
+  size_t count = nframes - first;
+  if (opts.length && opts.length < count)
+    count = opts.length;
+
+  libsox_(tensor_source_t) source;
+  memset(&source, 0, sizeof(source));
+  source.data = THTensor_(data)(input) + first * nchannels;
+  source.total = count * nchannels;
+  source.nchannels = nchannels;
+  source.wopts.normalized = opts.normalize;
+  source.seed = 0x9E3779B9;
+  sox_signalinfo_t signal;
+  memset(&signal, 0, sizeof(signal));
+  signal.rate = sample_rate;
+  signal.channels = nchannels;
+  signal.precision = 32;
+  signal.length = source.total;
+  sox_encodinginfo_t encoding;
+  memset(&encoding, 0, sizeof(encoding));
+  encoding.encoding = SOX_ENCODING_SIGN2;
+  encoding.bits_per_sample = 32;
+
+  libsox_(buffer_t) buffer;
+  libsox_(buffer_init)(&buffer, out);
+  const char *err = count == 0 ? "[apply_effects] no samples to process"
+    : libsox_(run_effects)(&libsox_(tensor_source), &source, signal, &encoding,
+                           &buffer, &sample_rate, &opts);
+  THTensor_(free)(input);
+  if (err) {
+    libsox_(buffer_free)(&buffer);
+    luaL_error(L, "%s", err);
+  }
+  THTensor *tensor = out ? out : THTensor_(new)();
+  libsox_(buffer_finish)(&buffer, tensor, NULL);
+  libsox_(push_output)(L, tensor, out, 4);
+  lua_pushnumber(L, (double) sample_rate);
+  return 2;
+}
+
+// arguments [archive-writer, tensor, sample_rate, options]
+// returns [index of the new clip (1-based)]
+static int libsox_(Main_archive_add)(lua_State *L) {
+  libsox_archive_writer_t *w = libsox_checkwriter(L, 1);
+  THTensor *src = luaT_checkudata(L, 2, torch_Tensor);
+  int sample_rate = luaL_checkint(L, 3);
+  libsox_write_opts_t opts;
+  libsox_check_write_opts(L, 4, &opts);
+  if (w->f == NULL)
+    luaL_error(L, "[archive_add] archive is closed");
+  long nchannels = THTensor_(nDimension)(src) > 1 ? src->size[1] : 1;
+  char *buffer;
+  size_t buffer_size;
+  libsox_(encode_memory)(src, w->extension, sample_rate, &opts, &buffer, &buffer_size);
+  const char *err = libsox_archive_append(w, buffer, buffer_size, src->size[0],
+                                          sample_rate, nchannels);
+  free(buffer);
+  if (err)
+    luaL_error(L, "%s", err);
+  lua_pushnumber(L, (double) w->count);
+  return 1;
+}
+
+// arguments [archive, index (1-based), tensor, options]
+// returns [sample_rate]. The clip is decoded from the mapped archive in
+// place, as decompress would decode it.
+static int libsox_(Main_archive_get)(lua_State *L) {
+  libsox_archive_t *a = libsox_checkarchive(L, 1);
+  long i = luaL_checklong(L, 2);
+  THTensor *tensor = luaT_checkudata(L, 3, torch_Tensor);
+  libsox_read_opts_t opts;
+  libsox_check_read_opts(L, 4, &opts);
+  if (!THTensor_(isContiguous)(tensor))
+    luaL_error(L, "opts.out should be contiguous");
+  libsox_archive_entry_t e;
+  const char *err = libsox_archive_entry(a, i - 1, &e);
+  if (err)
+    luaL_error(L, "%s", err);
+  sox_format_t *fd = sox_open_mem_read((void *)(a->m.base + e.offset), e.size,
+                                       NULL, NULL, a->extension);
+  if (fd == NULL)
+    luaL_error(L, "[archive_get] Failure to read clip %d", (int) i);
+  int sample_rate = 0;
+  libsox_(buffer_t) out;
+  libsox_(buffer_init)(&out, tensor);
+  err = libsox_(decode)(fd, &out, &sample_rate, e.length * e.channels, &opts);
+  sox_close(fd);
+  libsox_(buffer_finish)(&out, tensor, err);
+  lua_pushnumber(L, (double) sample_rate);
   return 1;
 }
 
@@ -241,6 +1282,11 @@ static const luaL_Reg libsox_(Main__)[] =
   {"save", libsox_(Main_save)},
   {"compress", libsox_(Main_compress)},
   {"decompress", libsox_(Main_decompress)},
+  {"stream_read", libsox_(Main_stream_read)},
+  {"load_batch", libsox_(Main_load_batch)},
+  {"archive_add", libsox_(Main_archive_add)},
+  {"archive_get", libsox_(Main_archive_get)},
+  {"apply_effects", libsox_(Main_apply_effects)},
   {NULL, NULL}
 };
 
@@ -36,14 +36,38 @@ require 'dok'
 require 'paths'
 require 'libaudio'
 
+----------------------------------------------------------------------
+-- the tensor whose libsox methods decode, which sets the output type:
+-- opts.out, an empty tensor of type opts.type, or a default tensor
+local function decoder(opts)
+   if opts and opts.out then
+      return opts.out
+   elseif opts and opts.type then
+      return torch.Tensor():type(opts.type)
+   end
+   return torch.Tensor()
+end
+
 ----------------------------------------------------------------------
 -- load from multiple formats
 --
-local function load(filename)
+local function load(filename, offset, duration, opts)
+   if type(offset) == 'table' then
+      opts, offset, duration = offset, nil, nil
+   end
    if not filename then
       print(dok.usage('audio.load',
                        'loads an audio file into a torch.Tensor', nil,
-                       {type='string', help='path to file', req=true}))
+                       {type='string', help='path to file', req=true},
+                       {type='number', help='first sample (per channel) to load, 0-based'},
+                       {type='number', help='number of samples (per channel) to load'},
+                       {type='table', help='options: normalize (scale samples to [-1, 1)), '
+                           .. 'rate (resample to this rate while decoding), '
+                           .. 'channels (channel number or list to keep), mono (average channels), '
+                           .. 'type (tensor type to decode into, e.g. torch.ShortTensor), '
+                           .. 'out (tensor to decode into, resized as needed), '
+                           .. 'effects (libsox effects to run while decoding, '
+                           .. 'e.g. {{\'speed\', 1.1}, \'gain -3\'})'}))
       dok.error('missing file name', 'audio.load')
    end
    if not paths.filep(filename) then
@@ -53,13 +77,19 @@ local function load(filename)
    if not xlua.require 'libsox' then
       dok.error('libsox package not found, please install libsox','audio.load')
    end
-   local a, sample_rate = torch.Tensor().libsox.load(filename)
+   if offset or duration then
+      local o = {}
+      for k, v in pairs(opts or {}) do o[k] = v end
+      o.offset, o.length = offset, duration
+      opts = o
+   end
+   local a, sample_rate = decoder(opts).libsox.load(filename, opts)
    return a, sample_rate
 end
 rawset(audio, 'load', load)
 --------------------------------------------------------------------------
 -- save to multiple formats
-local function save(filename, src, sample_rate)
+local function save(filename, src, sample_rate, opts)
    if not filename or not src then
       error('filename or src tensor missing')
    end
@@ -71,13 +101,13 @@ local function save(filename, src, sample_rate)
 	  .. 'Give a filename with an extension, for example: hello.wav')
    assert(sample_rate and type(sample_rate) == 'number',
 	  'provide a sample rate (a number) such as 22050')
-   src.libsox.save(filename, src, extension, sample_rate)
+   src.libsox.save(filename, src, extension, sample_rate, opts)
 end
 rawset(audio, 'save', save)
 --------------------------------------------------------------------------
 -- compress
 -- save to multiple formats
-function audio.compress(src, sample_rate, extension)
+function audio.compress(src, sample_rate, extension, opts)
    if not src then
       error('src tensor missing')
    end
@@ -87,12 +117,12 @@ function audio.compress(src, sample_rate, extension)
       dok.error('libsox package not found, please install libsox','audio.compress')
    end
    local out = torch.CharTensor()
-   src.libsox.compress(out, src, extension, sample_rate)
+   src.libsox.compress(out, src, extension, sample_rate, opts)
    return out
 end
 
 -- decompress
-function audio.decompress(src, extension)
+function audio.decompress(src, extension, opts)
    if not src then
       error('src tensor missing')
    end
@@ -102,7 +132,7 @@ function audio.decompress(src, extension)
    if not xlua.require 'libsox' then
       dok.error('libsox package not found, please install libsox','audio.decompress')
    end
-   local a, sample_rate = torch.Tensor().libsox.decompress(src, extension)
+   local a, sample_rate = decoder(opts).libsox.decompress(src, extension, opts)
    return a, sample_rate
 end
 
@@ -120,86 +150,547 @@ end
 function audio.decompressOGG(src)
    return audio.decompress(src, 'ogg')
 end
+----------------------------------------------------------------------
+-- loadBatch: decode many files (or compressed CharTensors) in parallel
+--
+local function loadBatch(items, nthreads, opts)
+   if type(nthreads) == 'table' then
+      opts, nthreads = nthreads, nil
+   end
+   if type(items) ~= 'table' then
+      print(dok.usage('audio.loadBatch',
+                       'decodes a list of audio files on a pool of native threads. '
+                          .. 'returns a table of tensors (false for items that failed), '
+                          .. 'a table of sample rates and a table of error messages. '
+                          .. 'with options.pad, returns a zero-padded '
+                          .. 'batch x NSamples x NChannels tensor and a LongTensor '
+                          .. 'of lengths instead of the table of tensors', nil,
+                       {type='table', help='paths to files, or CharTensors from audio.compress', req=true},
+                       {type='number', help='number of threads (default: all cores)'},
+                       {type='table', help='options of audio.load, plus pad and extension '
+                           .. '(format of CharTensor items)'}))
+      dok.error('missing list of files', 'audio.loadBatch')
+   end
+   if not xlua.require 'libsox' then
+      dok.error('libsox package not found, please install libsox','audio.loadBatch')
+   end
+   return decoder(opts).libsox.load_batch(items, nthreads or 0, opts)
+end
+rawset(audio, 'loadBatch', loadBatch)
+
+function audio.decompressBatch(items, extension, nthreads, opts)
+   local o = {}
+   for k, v in pairs(opts or {}) do o[k] = v end
+   o.extension = extension
+   return audio.loadBatch(items, nthreads, o)
+end
+
+----------------------------------------------------------------------
+-- stream: decode a file chunk by chunk
+--
+local function stream(filename, chunk_frames, opts)
+   if not filename or not chunk_frames then
+      print(dok.usage('audio.stream',
+                       'iterates over an audio file in chunks of chunk_frames '
+                          .. 'samples, yielding chunk_frames x NChannels tensors '
+                          .. '(the last chunk may be shorter)', nil,
+                       {type='string', help='path to file', req=true},
+                       {type='number', help='samples per channel in each chunk', req=true},
+                       {type='table', help='options, as in audio.load'}))
+      dok.error('missing arguments', 'audio.stream')
+   end
+   if not paths.filep(filename) then
+      dok.error('Specified filename: ' .. filename .. ' not found', 'audio.stream')
+   end
+   if not xlua.require 'libsox' then
+      dok.error('libsox package not found, please install libsox','audio.stream')
+   end
+   local handle = libsox.stream_open(filename, chunk_frames, opts)
+   local proto = decoder(opts)
+   local read = proto.libsox.stream_read
+   local function iterator()
+      local chunk = proto.new()
+      if read(handle, chunk) > 0 then
+         return chunk
+      end
+      handle:close()
+   end
+   return iterator, handle
+end
+rawset(audio, 'stream', stream)
+
+----------------------------------------------------------------------
+-- ArchiveWriter: many compressed clips in one file, with an index
+--
+local ArchiveWriter = torch.class('audio.ArchiveWriter')
+
+function ArchiveWriter:__init(filename, extension)
+   if not filename or not extension then
+      print(dok.usage('audio.ArchiveWriter',
+		      'writes clips compressed with the given format into one '
+			  .. 'file, indexed for random access by audio.Archive. '
+			  .. 'add(tensor, sample_rate, opts) appends a clip and returns its '
+			  .. 'index; close() writes the index. An existing archive is '
+			  .. 'appended to', nil,
+		      {type='string', help='path to the archive', req=true},
+		      {type='string', help='format of the clips, like ogg or flac', req=true}))
+      dok.error('missing arguments', 'audio.ArchiveWriter')
+   end
+   if not xlua.require 'libsox' then
+      dok.error('libsox package not found, please install libsox','audio.ArchiveWriter')
+   end
+   self.handle = libsox.archive_create(filename, extension)
+end
+
+-- opts are those of audio.save
+function ArchiveWriter:add(src, sample_rate, opts)
+   assert(sample_rate and type(sample_rate) == 'number',
+	  'provide a sample rate (a number) such as 22050')
+   return src.libsox.archive_add(self.handle, src, sample_rate, opts)
+end
+
+function ArchiveWriter:size()
+   return self.handle:size()
+end
+
+function ArchiveWriter:close()
+   self.handle:close()
+end
+
+----------------------------------------------------------------------
+-- Archive: random access to the clips of an ArchiveWriter file
+--
+local Archive = torch.class('audio.Archive')
+
+function Archive:__init(filename)
+   if not filename then
+      print(dok.usage('audio.Archive',
+		      'maps an archive written by audio.ArchiveWriter. get(i, opts) '
+			  .. 'decodes clip i straight from the mapping and returns it '
+			  .. 'with its sample rate; info(i) returns its length, sample '
+			  .. 'rate and channels without decoding it', nil,
+		      {type='string', help='path to the archive', req=true}))
+      dok.error('missing file name', 'audio.Archive')
+   end
+   if not paths.filep(filename) then
+      dok.error('Specified filename: ' .. filename .. ' not found', 'audio.Archive')
+   end
+   if not xlua.require 'libsox' then
+      dok.error('libsox package not found, please install libsox','audio.Archive')
+   end
+   self.handle = libsox.archive_open(filename)
+end
+
+-- opts are those of audio.load
+function Archive:get(i, opts)
+   local tensor = decoder(opts)
+   local sample_rate = tensor.libsox.archive_get(self.handle, i, tensor, opts)
+   return tensor, sample_rate
+end
+
+function Archive:info(i)
+   return self.handle:info(i)
+end
+
+function Archive:size()
+   return self.handle:size()
+end
+
+function Archive:close()
+   self.handle:close()
+end
+
+----------------------------------------------------------------------
+-- compactArchive: rewrite an archive without the dead space earlier
+-- writer sessions left behind
+--
+function audio.compactArchive(filename, output)
+   if not filename then
+      print(dok.usage('audio.compactArchive',
+		      'copies the clips of an archive into a new one with a single '
+			  .. 'index, reclaiming the indexes of earlier sessions and the '
+			  .. 'clips of sessions that were never closed. Without output, '
+			  .. 'the archive is replaced. Returns the number of bytes reclaimed', nil,
+		      {type='string', help='path to the archive', req=true},
+		      {type='string', help='path to write the compacted archive to'}))
+      dok.error('missing file name', 'audio.compactArchive')
+   end
+   if not paths.filep(filename) then
+      dok.error('Specified filename: ' .. filename .. ' not found', 'audio.compactArchive')
+   end
+   if not xlua.require 'libsox' then
+      dok.error('libsox package not found, please install libsox','audio.compactArchive')
+   end
+   local target = output or (filename .. '.compact')
+   local reclaimed = libsox.archive_compact(filename, target)
+   if not output then
+      -- readers that have the archive open keep the old file
+      local ok, err = os.rename(target, filename)
+      if not ok then
+         dok.error(err, 'audio.compactArchive')
+      end
+   end
+   return reclaimed
+end
+
+----------------------------------------------------------------------
+-- applyEffects: run a signal through a libsox effects chain
+--
+local function applyEffects(input, sample_rate, effects, opts)
+   if not input or not sample_rate or type(effects) ~= 'table' then
+      print(dok.usage('audio.applyEffects',
+                       'runs a signal through libsox effects, as the sox command '
+                          .. 'line would. returns the processed tensor, of the type of '
+                          .. 'the input, and its sample rate', nil,
+                       {type='torch.Tensor', help='NSamples, or NSamples x NChannels', req=true},
+                       {type='number', help='sample rate of input', req=true},
+                       {type='table', help='effects, each a table of name and arguments '
+                           .. 'or a string: {{\'speed\', 1.1}, \'gain -3\'}', req=true},
+                       {type='table', help='options of audio.load (normalize, rate, '
+                           .. 'channels, mono, offset, length, out)'}))
+      dok.error('missing arguments', 'audio.applyEffects')
+   end
+   if not xlua.require 'libsox' then
+      dok.error('libsox package not found, please install libsox','audio.applyEffects')
+   end
+   return input.libsox.apply_effects(input, sample_rate, effects, opts)
+end
+rawset(audio, 'applyEffects', applyEffects)
+
+----------------------------------------------------------------------
+-- resample: change the sample rate of a signal
+--
+local function resample(input, from, to)
+   if not input or not from or not to then
+      print(dok.usage('audio.resample',
+                       'resamples a signal with a polyphase windowed-sinc filter. '
+                          .. 'returns a tensor of the same type and layout with '
+                          .. 'ceil(NSamples * to / from) samples', nil,
+                       {type='torch.Tensor', help='NSamples, or NSamples x NChannels', req=true},
+                       {type='number', help='sample rate of input', req=true},
+                       {type='number', help='sample rate to convert to', req=true}))
+      dok.error('missing arguments', 'audio.resample')
+   end
+   return input.audio.resample(input, from, to)
+end
+rawset(audio, 'resample', resample)
+
+----------------------------------------------------------------------
+-- window names accepted by stft and spectrogram, and their native ids
+audio.window_types = {
+   rect = 1,
+   hamming = 2,
+   hann = 3,
+   bartlett = 4,
+   blackmanharris = 5,
+   sqrthann = 6,
+}
+
 ----------------------------------------------------------------------
 -- spectrogram
 --
+-- spectrogram modes, and their native ids
+audio.spectrogram_modes = {
+   magnitude = 1,
+   power = 2,
+   log = 3,
+   db = 4,
+}
+
 local function spectrogram(...)
-   local output, input, window_size, window_type, stride
-   local args = {...}
-   if select('#',...) == 4 then
-      input = args[1]
-      window_size = args[2]
-      window_type = args[3]
-      stride = args[4]
-   else
+   local output
+   -- unpacked without an args table: with opts.out, a call makes no garbage
+   local input, window_size, window_type, stride, opts = ...
+   if select('#',...) ~= 4 and select('#',...) ~= 5 then
       print(dok.usage('audio.spectrogram',
 		      'generate the spectrogram of an audio. '
 			  .. 'returns a 2D tensor, with '
-			  .. 'number_of_windows x window_size/2+1, '
+			  .. 'window_size/2+1 x number_of_windows, '
 			  .. 'each value representing the magnitude of '
-			  .. 'each frequency in dB', nil,
+			  .. 'each frequency in dB, or a 3D tensor with a leading '
+			  .. 'channel (or batch) dimension for multi-channel '
+			  .. '(or batched) input', nil,
 		      {type='torch.Tensor',
-		       help='input single-channel audio', req=true},
+		       help='input audio: NSamples, NSamples x NChannels, '
+			  .. 'or NBatch x NSamples with options.batch', req=true},
 		      {type='number', help='window size', req=true},
 		      {type='string',
-		       help='window type: rect, hamming, hann, bartlett' , req=true},
-		      {type='number', help='stride', req=true}))
+		       help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+		      {type='number', help='stride', req=true},
+		      {type='table', help='options: mode (magnitude, power, log, db), batched, batch, '
+			  .. 'out (tensor to write into, resized as needed)'}))
       dok.error('incorrect arguments', 'audio.spectrogram')
    end
+   local window_type_id = audio.window_types[window_type]
+   if not window_type_id then
+      dok.error('unknown window type: ' .. tostring(window_type), 'audio.spectrogram')
+   end
+   local mode = opts and opts.mode or 'log'
+   local mode_id = audio.spectrogram_modes[mode]
+   if not mode_id then
+      dok.error('unknown spectrogram mode: ' .. tostring(mode), 'audio.spectrogram')
+   end
+   -- window, transform and reduce each frame natively, without an
+   -- intermediate complex stft tensor
+   output = input.audio.spectrogram(input, window_size, window_type_id, stride,
+				    mode_id, opts)
+   return output
+end
+rawset(audio, 'spectrogram', spectrogram)
 
-   -- calculate stft
-   local stftout = audio.stft(input, window_size, window_type, stride)
+local function melspectrogram(...)
+   local output, input, window_size, window_type, stride, sample_rate, opts
+   local args = {...}
+   if select('#',...) == 5 or select('#',...) == 6 then
+      input = args[1]
+      window_size = args[2]
+      window_type = args[3]
+      stride = args[4]
+      sample_rate = args[5]
+      opts = args[6]
+   else
+      print(dok.usage('audio.melspectrogram',
+		      'generate the mel spectrogram of an audio. '
+			  .. 'returns a 2D tensor, with '
+			  .. 'n_mels x number_of_windows, lowest band first, '
+			  .. 'or a 3D tensor with a leading channel (or batch) '
+			  .. 'dimension for multi-channel (or batched) input', nil,
+		      {type='torch.Tensor',
+		       help='input audio: NSamples, NSamples x NChannels, '
+			  .. 'or NBatch x NSamples with options.batch', req=true},
+		      {type='number', help='window size (fft size)', req=true},
+		      {type='string',
+		       help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+		      {type='number', help='stride', req=true},
+		      {type='number', help='sample rate', req=true},
+		      {type='table', help='options: n_mels, fmin, fmax, '
+			  .. 'mode (magnitude, power, log, db), batched, batch'}))
+      dok.error('incorrect arguments', 'audio.melspectrogram')
+   end
+   local window_type_id = audio.window_types[window_type]
+   if not window_type_id then
+      dok.error('unknown window type: ' .. tostring(window_type), 'audio.melspectrogram')
+   end
+   local mode = opts and opts.mode or 'power'
+   local mode_id = audio.spectrogram_modes[mode]
+   if not mode_id then
+      dok.error('unknown spectrogram mode: ' .. tostring(mode), 'audio.melspectrogram')
+   end
+   output = input.audio.melspectrogram(input, window_size, window_type_id, stride,
+				       sample_rate, mode_id, opts)
+   return output
+end
+rawset(audio, 'melspectrogram', melspectrogram)
 
-   -- calculate magnitude of signal and convert to dB to make it look prettier
-   local stftout_r = stftout:select(3,1)
-   local stftout_c = stftout:select(3,2)
-   stftout_r:pow(2)
-   stftout_c:pow(2)
-   local stftout_magnitude = stftout_r + stftout_c
-   stftout_magnitude = stftout_magnitude + 0.01 -- adding constant to avoid log(0)
-   output = stftout_magnitude:log() * 10
-   return output:transpose(1,2)
+local function mfcc(...)
+   local output, input, window_size, window_type, stride, sample_rate, opts
+   local args = {...}
+   if select('#',...) == 5 or select('#',...) == 6 then
+      input = args[1]
+      window_size = args[2]
+      window_type = args[3]
+      stride = args[4]
+      sample_rate = args[5]
+      opts = args[6]
+   else
+      print(dok.usage('audio.mfcc',
+		      'calculate the mel-frequency cepstral coefficients of an audio. '
+			  .. 'returns a 2D tensor, with '
+			  .. 'n_mfcc x number_of_windows, '
+			  .. 'or a 3D tensor with a leading channel (or batch) '
+			  .. 'dimension for multi-channel (or batched) input', nil,
+		      {type='torch.Tensor',
+		       help='input audio: NSamples, NSamples x NChannels, '
+			  .. 'or NBatch x NSamples with options.batch', req=true},
+		      {type='number', help='window size (fft size)', req=true},
+		      {type='string',
+		       help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+		      {type='number', help='stride', req=true},
+		      {type='number', help='sample rate', req=true},
+		      {type='table', help='options: n_mfcc, n_mels, fmin, fmax, batched, batch'}))
+      dok.error('incorrect arguments', 'audio.mfcc')
+   end
+   local window_type_id = audio.window_types[window_type]
+   if not window_type_id then
+      dok.error('unknown window type: ' .. tostring(window_type), 'audio.mfcc')
+   end
+   output = input.audio.mfcc(input, window_size, window_type_id, stride,
+			     sample_rate, opts)
+   return output
 end
-rawset(audio, 'spectrogram', spectrogram)
+rawset(audio, 'mfcc', mfcc)
 
 local function stft(...)
-    local output, input, window_size, window_type, stride
-    local args = {...}
-    if select('#',...) == 4 then
-	input = args[1]
-	window_size = args[2]
-	window_type = args[3]
-	stride = args[4]
-    else
+    local output
+    -- unpacked without an args table: with opts.out, a call makes no garbage
+    local input, window_size, window_type, stride, opts = ...
+    if select('#',...) ~= 4 and select('#',...) ~= 5 then
 	print(dok.usage('audio.stft',
 			'calculate the stft of an audio. '
 			    .. 'returns a 3D tensor, with '
 			    .. 'number_of_windows x window_size/2+1 x 2 '
-			    .. ' (complex number with real and complex parts)', nil,
+			    .. ' (complex number with real and complex parts), '
+			    .. 'or a 4D tensor with a leading channel (or batch) '
+			    .. 'dimension for multi-channel (or batched) input', nil,
 			{type='torch.Tensor',
-			 help='input single-channel audio', req=true},
+			 help='input audio: NSamples, NSamples x NChannels, '
+			    .. 'or NBatch x NSamples with options.batch', req=true},
 			{type='number', help='window size', req=true},
 			{type='string',
-			 help='window type: rect, hamming, hann, bartlett' , req=true},
-			{type='number', help='stride', req=true}))
+			 help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+			{type='number', help='stride', req=true},
+			{type='table', help='options: batched, batch, '
+			    .. 'order (reversed, natural), major (frame, bin), '
+			    .. 'complex (interleaved, split), '
+			    .. 'out (tensor to write into, resized as needed)'}))
 	dok.error('incorrect arguments', 'audio.stft')
     end
-    local window_type_id;
-    if window_type == 'rect' then
-	window_type_id = 1
-    elseif window_type == 'hamming' then
-	window_type_id = 2
-    elseif window_type == 'hann' then
-	window_type_id = 3
-    elseif window_type == 'bartlett' then
-	window_type_id = 4
+    local window_type_id = audio.window_types[window_type]
+    if not window_type_id then
+	dok.error('unknown window type: ' .. tostring(window_type), 'audio.stft')
     end
     -- calculate stft
-    output = torch.Tensor().audio.stft(input, window_size, window_type_id, stride)
+    output = input.audio.stft(input, window_size, window_type_id, stride, opts)
     return output
 end
 rawset(audio, 'stft', stft)
 
+local function istft(...)
+   local output, input, window_size, window_type, stride, opts
+   local args = {...}
+   if select('#',...) == 4 or select('#',...) == 5 then
+      input = args[1]
+      window_size = args[2]
+      window_type = args[3]
+      stride = args[4]
+      opts = args[5]
+   else
+      print(dok.usage('audio.istft',
+		      'resynthesize audio from the output of audio.stft by '
+			  .. 'weighted overlap-add. returns a 1D tensor of '
+			  .. '(number_of_windows-1)*stride+window_size samples, '
+			  .. 'or NSamples x NChannels (NBatch x NSamples with '
+			  .. 'options.batch) for 4D input', nil,
+		      {type='torch.Tensor',
+		       help='number_of_windows x window_size/2+1 x 2, as returned by audio.stft, '
+			  .. 'or with a leading channel (or batch) dimension', req=true},
+		      {type='number', help='window size', req=true},
+		      {type='string',
+		       help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+		      {type='number', help='stride', req=true},
+		      {type='table', help='options: batch, and order, major, complex '
+			  .. 'describing the input layout as for audio.stft'}))
+      dok.error('incorrect arguments', 'audio.istft')
+   end
+   local window_type_id = audio.window_types[window_type]
+   if not window_type_id then
+      dok.error('unknown window type: ' .. tostring(window_type), 'audio.istft')
+   end
+   output = input.audio.istft(input, window_size, window_type_id, stride, opts)
+   return output
+end
+rawset(audio, 'istft', istft)
+
+----------------------------------------------------------------------
+-- STFTStream: stft of a live signal, pushed chunk by chunk
+--
+local STFTStream = torch.class('audio.STFTStream')
+
+function STFTStream:__init(window_size, window_type, stride)
+   if not window_size or not window_type or not stride then
+      print(dok.usage('audio.STFTStream',
+		      'incremental stft over a signal that arrives in chunks. '
+			  .. 'push(chunk) returns the frames the chunk completed, '
+			  .. 'as a number_of_new_windows x window_size/2+1 x 2 tensor '
+			  .. '(empty when none); flush() returns the zero-padded '
+			  .. 'frames covering the remaining samples and restarts the stream', nil,
+		      {type='number', help='window size', req=true},
+		      {type='string',
+		       help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+		      {type='number', help='stride', req=true}))
+      dok.error('missing arguments', 'audio.STFTStream')
+   end
+   local window_type_id = audio.window_types[window_type]
+   if not window_type_id then
+      dok.error('unknown window type: ' .. tostring(window_type), 'audio.STFTStream')
+   end
+   self.window_size = window_size
+   self.stride = stride
+   self.handle = audio.stft_stream_open(window_size, window_type_id, stride)
+   self.output = torch.Tensor()
+end
+
+-- the returned tensor is reused by the next push or flush
+function STFTStream:push(chunk)
+   if torch.type(self.output) ~= torch.type(chunk) then
+      self.output = chunk.new()
+   end
+   chunk.audio.stft_push(self.handle, chunk, self.output)
+   return self.output
+end
+
+function STFTStream:flush()
+   self.output.audio.stft_flush(self.handle, self.output)
+   return self.output
+end
+
+-- number of buffered samples not yet covered by a returned frame
+function STFTStream:pending()
+   return self.handle:pending()
+end
+
+function STFTStream:reset()
+   self.handle:reset()
+end
+
+----------------------------------------------------------------------
+-- ISTFTStream: overlap-add synthesis of frames pushed a few at a time
+--
+local ISTFTStream = torch.class('audio.ISTFTStream')
+
+function ISTFTStream:__init(window_size, window_type, stride)
+   if not window_size or not window_type or not stride then
+      print(dok.usage('audio.ISTFTStream',
+		      'incremental istft over frames that arrive a few at a time. '
+			  .. 'push(frames) returns the stride samples each frame '
+			  .. 'finished; flush() returns the window_size-stride '
+			  .. 'samples the last frame still overlaps and restarts the stream', nil,
+		      {type='number', help='window size', req=true},
+		      {type='string',
+		       help='window type: rect, hamming, hann, bartlett, blackmanharris, sqrthann' , req=true},
+		      {type='number', help='stride', req=true}))
+      dok.error('missing arguments', 'audio.ISTFTStream')
+   end
+   local window_type_id = audio.window_types[window_type]
+   if not window_type_id then
+      dok.error('unknown window type: ' .. tostring(window_type), 'audio.ISTFTStream')
+   end
+   self.window_size = window_size
+   self.stride = stride
+   self.handle = audio.istft_stream_open(window_size, window_type_id, stride)
+   self.output = torch.Tensor()
+end
+
+-- frames: number_of_windows x window_size/2+1 x 2, or a single
+-- window_size/2+1 x 2 frame. The returned tensor is reused by the next
+-- push or flush.
+function ISTFTStream:push(frames)
+   if torch.type(self.output) ~= torch.type(frames) then
+      self.output = frames.new()
+   end
+   frames.audio.istft_push(self.handle, frames, self.output)
+   return self.output
+end
+
+function ISTFTStream:flush()
+   self.output.audio.istft_flush(self.handle, self.output)
+   return self.output
+end
+
+function ISTFTStream:reset()
+   self.handle:reset()
+end
+
 local function cqt(...)
    local output, input, fmin, fmax, bins_per_octave, sample_rate
    local args = {...}
@@ -207,11 +698,15 @@ local function cqt(...)
       input = args[1]
       fmin = args[2]
       fmax = args[3]
-      bins_per_octave = args[3]
-      sample_rate = args[4]
+      bins_per_octave = args[4]
+      sample_rate = args[5]
    else
       print(dok.usage('audio.cqt',
-		      'calculate the constant-Q transformed audio signal. returns a [TODO: fill this description]', nil,
+		      'calculate the constant-Q transformed audio signal. '
+			  .. 'returns a 3D tensor, with '
+			  .. 'octaves*bins_per_octave x number_of_frames x 2 '
+			  .. '(complex number with real and complex parts), '
+			  .. 'lowest frequency first', nil,
 		      {type='torch.Tensor', help='input single-channel audio', req=true},
 		      {type='number', help='lowest frequency of interest', req=true},
 		      {type='number', help='highest frequency of interest', req=true},
@@ -220,7 +715,7 @@ local function cqt(...)
       dok.error('incorrect arguments', 'audio.cqt')
    end
    -- calculate cqt
-   output = torch.Tensor().audio.cqt(input, fmin, fmax, bins_per_octave, sample_rate)
+   output = input.audio.cqt(input, fmin, fmax, bins_per_octave, sample_rate)
    return output
 end
 rawset(audio, 'cqt', cqt)
@@ -235,4 +730,6 @@ local function samplevoice()
 end
 rawset(audio, 'samplevoice', samplevoice)
 
+torch.include('audio', 'benchmark.lua')
+
 return audio
@@ -0,0 +1,137 @@
+#ifndef AUDIO_RESAMPLE_H
+#define AUDIO_RESAMPLE_H
+
+////////////////////////////////////////////////////////////////////////////
+// Polyphase windowed-sinc resampling, shared by libaudio (audio.resample)
+// and libsox (load with options.rate). Each library keeps its own kernel
+// cache; the typed streaming loops are in generic/resample.c.
+//
+// A rate change from -> to is reduced to up/down = to/from. Output n sits
+// at input position n * down / up = i + p/up, so one of up phases of the
+// filter applies. Each phase is a Kaiser-windowed sinc, low-passed at
+// AUDIO_RESAMPLE_ROLLOFF of the lower Nyquist frequency, with
+// AUDIO_RESAMPLE_ZEROS zero crossings on either side, padded to a multiple
+// of 4 taps for the SIMD dot products and normalized to unit DC gain.
+// Kernels are built once per (from, to) and kept for the life of the
+// process, like the window tables.
+
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define AUDIO_RESAMPLE_ZEROS 16
+#define AUDIO_RESAMPLE_ROLLOFF 0.945
+#define AUDIO_RESAMPLE_BETA 8.6
+// largest up supported; 8k <-> 44.1k needs 441, 11.025k -> 48k needs 640
+#define AUDIO_RESAMPLE_MAX_PHASES 4096
+
+#define resample_(NAME) TH_CONCAT_3(resample_, Real, NAME)
+
+typedef struct audio_resample_kernel {
+  long from, to;
+  long up, down;
+  long half;     // filter half-width, in input samples
+  long taps;     // per phase, a multiple of 4
+  double *coef;  // up rows of taps: tap j of phase p weighs input i - half + 1 + j
+  float *coeff;  // the same, in single precision
+  struct audio_resample_kernel *next;
+} audio_resample_kernel_t;
+
+static audio_resample_kernel_t *audio_resample_kernels = NULL;
+static pthread_mutex_t audio_resample_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long audio_resample_gcd(long a, long b)
+{
+  while (b) {
+    long t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// NULL if from -> to can be resampled, else why not
+static const char *audio_resample_check(long from, long to)
+{
+  if (from <= 0 || to <= 0)
+    return "[resample] sample rates should be positive";
+  if (to / audio_resample_gcd(from, to) > AUDIO_RESAMPLE_MAX_PHASES)
+    return "[resample] rate ratio needs too many filter phases";
+  return NULL;
+}
+
+// modified Bessel function of the first kind, order 0
+static double audio_resample_i0(double x)
+{
+  double sum = 1, term = 1, q = x * x / 4;
+  int k;
+  for (k = 1; k < 64 && term > sum * 1e-17; k++) {
+    term *= q / ((double)k * k);
+    sum += term;
+  }
+  return sum;
+}
+
+static void audio_resample_fill(audio_resample_kernel_t *e)
+{
+  const double cutoff = (e->up < e->down ? (double)e->up / e->down : 1.0)
+    * AUDIO_RESAMPLE_ROLLOFF;
+  const double norm = audio_resample_i0(AUDIO_RESAMPLE_BETA);
+  long p, j;
+  e->half = (long)ceil(AUDIO_RESAMPLE_ZEROS / cutoff);
+  e->taps = (2 * e->half + 3) & ~3L;
+  e->coef = (double *)malloc(sizeof(double) * e->up * e->taps);
+  e->coeff = (float *)malloc(sizeof(float) * e->up * e->taps);
+  for (p = 0; p < e->up; p++) {
+    double *row = e->coef + p * e->taps, sum = 0;
+    for (j = 0; j < e->taps; j++) {
+      // distance from the output position to the input this tap weighs
+      double t = (double)p / e->up + e->half - 1 - j, x = t / e->half;
+      double v = 0;
+      if (fabs(x) < 1) {
+        double a = M_PI * cutoff * t;
+        v = (a == 0 ? 1 : sin(a) / a)
+          * audio_resample_i0(AUDIO_RESAMPLE_BETA * sqrt(1 - x * x)) / norm;
+      }
+      row[j] = v;
+      sum += v;
+    }
+    for (j = 0; j < e->taps; j++) {
+      row[j] /= sum;
+      e->coeff[p * e->taps + j] = (float)row[j];
+    }
+  }
+}
+
+// from -> to should have passed audio_resample_check
+static const audio_resample_kernel_t *audio_resample_kernel(long from, long to)
+{
+  audio_resample_kernel_t *e;
+  pthread_mutex_lock(&audio_resample_lock);
+  for (e = audio_resample_kernels; e; e = e->next)
+    if (e->from == from && e->to == to)
+      break;
+  if (e == NULL) {
+    long g = audio_resample_gcd(from, to);
+    e = (audio_resample_kernel_t *)malloc(sizeof(audio_resample_kernel_t));
+    e->from = from;
+    e->to = to;
+    e->up = to / g;
+    e->down = from / g;
+    audio_resample_fill(e);
+    e->next = audio_resample_kernels;
+    audio_resample_kernels = e;
+  }
+  pthread_mutex_unlock(&audio_resample_lock);
+  return e;
+}
+
+// number of output samples for n input samples
+static long audio_resample_length(const audio_resample_kernel_t *k, long n)
+{
+  return (n * k->up + k->down - 1) / k->down;
+}
+
+#endif
@@ -5,9 +5,33 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
 
 #include <sox.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <pthread.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define LIBSOX_HAVE_MMAP 1
+#else
+#define LIBSOX_HAVE_MMAP 0
+#endif
+
+#include "resample.h"
+
+#if LUA_VERSION_NUM >= 502
+#define lua_objlen(L,i)         lua_rawlen(L, (i))
+#endif
+
 #if LUA_VERSION_NUM >= 503
 #define luaL_checklong(L,n)     ((long)luaL_checkinteger(L, (n)))
 #define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
@@ -27,6 +51,1386 @@ void abort_(const char * s, ...)
 #define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
 #define libsox_(NAME) TH_CONCAT_3(libsox_, Real, NAME)
 
+// Number of samples decoded per sox_read call. Large enough to amortize the
+// call overhead, small enough for the int32 staging block to stay in cache.
+#define LIBSOX_BLOCK 8192
+
+// scale that maps the full sox_sample_t range onto [-1, 1)
+#define LIBSOX_NORM (1.0 / ((double)SOX_SAMPLE_MAX + 1.0))
+
+#if defined(_MSC_VER)
+#define LIBSOX_THREAD_LOCAL __declspec(thread)
+#else
+#define LIBSOX_THREAD_LOCAL __thread
+#endif
+
+// Staging block for decoding into non-int tensors. There is one per thread,
+// since load_batch decodes on several, and it lives as long as its thread,
+// so repeated loads allocate nothing but (at most) their output.
+static LIBSOX_THREAD_LOCAL sox_sample_t *libsox_block_ = NULL;
+
+static sox_sample_t *libsox_block(void)
+{
+  if (libsox_block_ == NULL)
+    libsox_block_ = (sox_sample_t *)malloc(sizeof(sox_sample_t) * LIBSOX_BLOCK);
+  return libsox_block_;
+}
+
+// Allocator of the storages that wrap memory malloc'ed outside TH: decoded
+// samples (see libsox_(buffer_t)) and compress's encoded bytes. When TH
+// resizes such a storage itself, it fails as THAlloc does.
+static void *libsox_malloc(void *ctx, ptrdiff_t size)
+{
+  void *ptr = malloc(size > 0 ? size : 1);
+  (void)ctx;
+  if (ptr == NULL)
+    THError("[libsox] not enough memory to allocate %ld bytes", (long)size);
+  return ptr;
+}
+
+static void *libsox_realloc(void *ctx, void *ptr, ptrdiff_t size)
+{
+  void *p = realloc(ptr, size > 0 ? size : 1);
+  (void)ctx;
+  if (p == NULL)
+    THError("[libsox] not enough memory to allocate %ld bytes", (long)size);
+  return p;
+}
+
+static void libsox_free(void *ctx, void *ptr)
+{
+  (void)ctx;
+  free(ptr);
+}
+
+static THAllocator libsox_allocator = {
+  libsox_malloc, libsox_realloc, libsox_free
+};
+
+////////////////////////////////////////////////////////////////////////////
+// Decode options, passed from lua as an optional table
+
+// most channels options.channels can select
+#define LIBSOX_MAX_SELECT 64
+
+// options.effects: a libsox effects chain, as words of sox command lines.
+// Words are kept as offsets into text rather than pointers, so that the
+// options can be copied.
+#define LIBSOX_MAX_EFFECTS 32
+#define LIBSOX_MAX_EFFECT_WORDS 32
+#define LIBSOX_EFFECTS_TEXT 2048
+
+typedef struct {
+  int n;                                      // number of effects, 0 for none
+  int nwords[LIBSOX_MAX_EFFECTS];             // name and arguments of each
+  short word[LIBSOX_MAX_EFFECTS][LIBSOX_MAX_EFFECT_WORDS];
+  short used;
+  char text[LIBSOX_EFFECTS_TEXT];
+} libsox_effects_t;
+
+typedef struct {
+  int normalize;  // scale samples to [-1, 1) (float and double tensors only)
+  size_t offset;  // frames to skip before decoding
+  size_t length;  // frames to decode, 0 for everything after offset
+  long rate;      // resample to this rate while decoding, 0 to keep the file's
+  int mono;       // average the (selected) channels into one
+  int nselect;    // number of channels selected, 0 for all of them
+  int select[LIBSOX_MAX_SELECT]; // 0-based file channel of each output channel
+  libsox_effects_t effects; // run the decoded samples through these
+  int legacy;     // blobs of a format without a signature have compress's old prefix
+} libsox_read_opts_t;
+
+static void libsox_effects_word(lua_State *L, libsox_effects_t *fx, const char *w, size_t len)
+{
+  int e = fx->n;
+  if (fx->nwords[e] == LIBSOX_MAX_EFFECT_WORDS)
+    luaL_error(L, "at most %d arguments per effect", LIBSOX_MAX_EFFECT_WORDS - 1);
+  if (fx->used + len + 1 > LIBSOX_EFFECTS_TEXT)
+    luaL_error(L, "effects are too long");
+  fx->word[e][fx->nwords[e]++] = fx->used;
+  memcpy(fx->text + fx->used, w, len);
+  fx->text[fx->used + len] = 0;
+  fx->used += len + 1;
+}
+
+// Parse the list of effects at idx. Each effect is a table, its name then
+// its arguments ({'speed', 1.1}), or a string of space separated words
+// ('speed 1.1'), as they would follow the file names of a sox command.
+static void libsox_check_effects(lua_State *L, int idx, libsox_effects_t *fx)
+{
+  int i, j, n = (int)lua_objlen(L, idx);
+  memset(fx, 0, sizeof(libsox_effects_t));
+  if (n > LIBSOX_MAX_EFFECTS)
+    luaL_error(L, "at most %d effects can be chained", LIBSOX_MAX_EFFECTS);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, idx, i + 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      const char *p = lua_tostring(L, -1);
+      while (*p) {
+        size_t len = strcspn(p, " \t");
+        if (len)
+          libsox_effects_word(L, fx, p, len);
+        p += len;
+        p += strspn(p, " \t");
+      }
+    } else if (lua_istable(L, -1)) {
+      int m = (int)lua_objlen(L, -1);
+      for (j = 0; j < m; j++) {
+        size_t len;
+        lua_rawgeti(L, -1, j + 1);
+        if (!lua_isstring(L, -1))
+          luaL_error(L, "effect arguments should be strings or numbers");
+        // a number is converted on the stack, not in the caller's table
+        const char *w = lua_tolstring(L, -1, &len);
+        libsox_effects_word(L, fx, w, len);
+        lua_pop(L, 1);
+      }
+    } else {
+      luaL_error(L, "effects should be a list of tables or strings");
+    }
+    if (fx->nwords[i] == 0)
+      luaL_error(L, "effect %d has no name", i + 1);
+    lua_pop(L, 1);
+    fx->n++;
+  }
+}
+
+static void libsox_check_read_opts(lua_State *L, int idx, libsox_read_opts_t *opts)
+{
+  memset(opts, 0, sizeof(libsox_read_opts_t));
+  if (lua_isnoneornil(L, idx))
+    return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, "normalize");
+  opts->normalize = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "legacy");
+  opts->legacy = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "offset");
+  double offset = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+  lua_getfield(L, idx, "length");
+  double length = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+  lua_getfield(L, idx, "rate");
+  double rate = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+  lua_pop(L, 5);
+  if (offset < 0 || length < 0)
+    luaL_error(L, "offset and length should be non-negative");
+  if (rate < 0)
+    luaL_error(L, "rate should be positive");
+  opts->offset = (size_t)offset;
+  opts->length = (size_t)length;
+  opts->rate = (long)floor(rate + 0.5);
+
+  lua_getfield(L, idx, "mono");
+  opts->mono = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "channels");
+  if (lua_isnumber(L, -1)) {
+    opts->nselect = 1;
+    opts->select[0] = (int)lua_tonumber(L, -1) - 1;
+  } else if (lua_istable(L, -1)) {
+    int i, n = (int)lua_objlen(L, -1);
+    if (n > LIBSOX_MAX_SELECT)
+      luaL_error(L, "at most %d channels can be selected", LIBSOX_MAX_SELECT);
+    for (i = 0; i < n; i++) {
+      lua_rawgeti(L, -1, i + 1);
+      if (!lua_isnumber(L, -1))
+        luaL_error(L, "channels should be a channel number or a list of them");
+      opts->select[i] = (int)lua_tonumber(L, -1) - 1;
+      lua_pop(L, 1);
+    }
+    opts->nselect = n;
+  } else if (!lua_isnil(L, -1)) {
+    luaL_error(L, "channels should be a channel number or a list of them");
+  }
+  lua_pop(L, 2);
+
+  lua_getfield(L, idx, "effects");
+  if (lua_istable(L, -1))
+    libsox_check_effects(L, lua_gettop(L), &opts->effects);
+  else if (!lua_isnil(L, -1))
+    luaL_error(L, "effects should be a list of tables or strings");
+  lua_pop(L, 1);
+}
+
+// Channels of the decoded tensor for a file of nchannels channels
+static long libsox_output_channels(long nchannels, const libsox_read_opts_t *opts)
+{
+  if (opts->mono)
+    return 1;
+  return opts->nselect ? opts->nselect : nchannels;
+}
+
+// 1 when the decode selects or mixes channels rather than keeping the file's
+static int libsox_mapped(const libsox_read_opts_t *opts)
+{
+  return opts->mono || opts->nselect;
+}
+
+// NULL if the selected channels exist in a file of nchannels channels
+static const char *libsox_check_channels(long nchannels, const libsox_read_opts_t *opts)
+{
+  int i;
+  for (i = 0; i < opts->nselect; i++)
+    if (opts->select[i] < 0 || opts->select[i] >= nchannels)
+      return "[read_audio] selected channel does not exist in the file";
+  if (libsox_mapped(opts) && nchannels > LIBSOX_BLOCK)
+    return "[read_audio] too many channels to select or mix";
+  return NULL;
+}
+
+// Output channel j of one decoded frame, in sox sample units
+static inline double libsox_mix(const sox_sample_t *frame, long nchannels, long j,
+                                const libsox_read_opts_t *opts)
+{
+  if (opts->mono) {
+    double sum = 0;
+    long c;
+    if (opts->nselect) {
+      for (c = 0; c < opts->nselect; c++)
+        sum += frame[opts->select[c]];
+      return sum / opts->nselect;
+    }
+    for (c = 0; c < nchannels; c++)
+      sum += frame[c];
+    return sum / nchannels;
+  }
+  return frame[opts->nselect ? opts->select[j] : j];
+}
+
+// Read up to wanted samples (a multiple of the channel count) into block,
+// as whole frames: sox_read may return short counts, even part of a frame.
+// A partial frame at the end of the file is dropped.
+static size_t libsox_read_frames(sox_format_t *fd, sox_sample_t *block, size_t wanted)
+{
+  size_t n = 0, got;
+  while (n < wanted && (got = sox_read(fd, block + n, wanted - n)) > 0)
+    n += got;
+  return n - n % fd->signal.channels;
+}
+
+// Position fd offset frames into the stream. Uses sox_seek when the format
+// supports it, otherwise decodes and discards whole blocks without converting
+// them. Returns the number of frames actually skipped.
+static size_t libsox_skip(sox_format_t *fd, size_t offset)
+{
+  size_t nchannels = fd->signal.channels;
+  size_t wanted = offset * nchannels;
+  if (wanted == 0)
+    return 0;
+  if (fd->seekable && fd->handler.seek
+      && sox_seek(fd, wanted, SOX_SEEK_SET) == SOX_SUCCESS)
+    return offset;
+
+  sox_sample_t *block = (sox_sample_t *)malloc(sizeof(sox_sample_t) * LIBSOX_BLOCK);
+  size_t skipped = 0;
+  while (skipped < wanted) {
+    size_t n = wanted - skipped;
+    n = sox_read(fd, block, n < LIBSOX_BLOCK ? n : LIBSOX_BLOCK);
+    if (n == 0)
+      break;
+    skipped += n;
+  }
+  free(block);
+  return skipped / nchannels;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// One entry of a load_batch call. Either filename is set, or data/size point
+// at the bytes of a CharTensor produced by compress. Workers only touch their
+// own entry and report failure by copying the error into err, since decode's
+// errors may live in a per-thread buffer that the thread reuses.
+typedef struct {
+  const char *filename;
+  char *data;
+  size_t size;
+  int sample_rate;
+  char err[256];     // empty when the item decoded
+} libsox_batch_item_t;
+
+// Run work(ctx, i) for every i in [0, n) on nthreads threads, the calling
+// thread being one of them; nthreads <= 0 means one per online processor.
+// Each thread takes the next i from a shared counter, so that a long item
+// does not hold up the others. If threads cannot be started, the calling
+// thread does the rest of the work. work must not call into lua or TH.
+typedef struct {
+  pthread_mutex_t lock;
+  long next, n;
+  void (*work)(void *ctx, long i);
+  void *ctx;
+} libsox_pool_t;
+
+static void libsox_pool_work(libsox_pool_t *p)
+{
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    long i = p->next++;
+    pthread_mutex_unlock(&p->lock);
+    if (i >= p->n)
+      return;
+    p->work(p->ctx, i);
+  }
+}
+
+static void *libsox_pool_thread(void *arg)
+{
+  libsox_pool_work((libsox_pool_t *)arg);
+  // the thread ends here, and its staging block with it
+  free(libsox_block_);
+  libsox_block_ = NULL;
+  return NULL;
+}
+
+static void libsox_pool_run(long n, int nthreads, void (*work)(void *ctx, long i), void *ctx)
+{
+  libsox_pool_t p;
+  pthread_t *threads = NULL;
+  long started = 0, t;
+  if (nthreads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    nthreads = 1;
+#endif
+  }
+  if (nthreads > n)
+    nthreads = (int)n;
+  p.next = 0;
+  p.n = n;
+  p.work = work;
+  p.ctx = ctx;
+  pthread_mutex_init(&p.lock, NULL);
+  if (nthreads > 1)
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * (nthreads - 1));
+  if (threads)
+    for (t = 0; t < nthreads - 1; t++)
+      if (pthread_create(&threads[started], NULL, libsox_pool_thread, &p) == 0)
+        started++;
+  libsox_pool_work(&p);
+  for (t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+  pthread_mutex_destroy(&p.lock);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Encode options, passed from lua as an optional table
+typedef struct {
+  int normalized;  // input is in [-1, 1), scale it to the full sox range
+  int dither;      // add TPDF dither at the output bit depth
+  int bits;        // output bits per sample, 0 for the format's default
+} libsox_write_opts_t;
+
+static void libsox_check_write_opts(lua_State *L, int idx, libsox_write_opts_t *opts)
+{
+  memset(opts, 0, sizeof(libsox_write_opts_t));
+  if (lua_isnoneornil(L, idx))
+    return;
+  luaL_checktype(L, idx, LUA_TTABLE);
+  lua_getfield(L, idx, "normalized");
+  opts->normalized = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "dither");
+  opts->dither = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "bits");
+  opts->bits = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : 0;
+  lua_pop(L, 3);
+  if (opts->bits < 0 || opts->bits > 32)
+    luaL_error(L, "bits should be between 1 and 32, or 0 for the format's default");
+}
+
+// Fill in the signal and encoding descriptions for a writer. Returns the
+// encoding to hand to sox_open_write, or NULL to let the format choose.
+static sox_encodinginfo_t *libsox_write_info(sox_signalinfo_t *sinfo,
+                                             sox_encodinginfo_t *einfo,
+                                             int sample_rate, long nchannels,
+                                             long nsamples,
+                                             const libsox_write_opts_t *opts)
+{
+  sinfo->rate = sample_rate;
+  sinfo->channels = nchannels;
+  sinfo->length = nsamples * nchannels;
+  sinfo->precision = sizeof(int32_t) * 8; /* precision in bits */
+#if SOX_LIB_VERSION_CODE >= 918272 // >= 14.3.0
+  sinfo->mult = NULL;
+#endif
+  if (opts->bits == 0)
+    return NULL;
+  // same defaults as sox_init_encodinginfo, which older libsox lacks
+  memset(einfo, 0, sizeof(sox_encodinginfo_t));
+  einfo->encoding = SOX_ENCODING_UNKNOWN;
+  einfo->bits_per_sample = opts->bits;
+  einfo->compression = HUGE_VAL;
+  einfo->reverse_bytes = sox_option_default;
+  einfo->reverse_nibbles = sox_option_default;
+  einfo->reverse_bits = sox_option_default;
+  einfo->opposite_endian = sox_false;
+  return einfo;
+}
+
+// round to nearest and clip to the sox_sample_t range
+static inline sox_sample_t libsox_saturate(double v)
+{
+  if (v >= (double)SOX_SAMPLE_MAX)
+    return SOX_SAMPLE_MAX;
+  if (v <= (double)SOX_SAMPLE_MIN)
+    return SOX_SAMPLE_MIN;
+  return (sox_sample_t)lrint(v);
+}
+
+// uniform in [0, 1), xorshift32. only used for dither, so quality is not critical.
+static inline double libsox_uniform(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x * (1.0 / 4294967296.0);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Memory-mapped PCM WAV.
+// Integer PCM WAV files are read straight from a read-only mapping of the
+// file rather than through libsox, so a decode only faults in the pages of
+// the window it asked for, and a 16 bit file loaded into a ShortTensor is
+// not even copied (see libsox_(load_mapped)). Samples are scaled exactly as
+// libsox's wav reader scales them. Anything the parser below does not
+// recognise, including every compressed format, still goes through libsox.
+typedef struct {
+  const unsigned char *base;
+  size_t size;
+} libsox_map_t;
+
+typedef struct {
+  long channels;
+  long rate;
+  int bytes;       // per sample: 1 (unsigned), 2, 3 or 4 (signed)
+  size_t data;     // file offset of the first sample
+  size_t nframes;
+} libsox_wav_t;
+
+static inline uint32_t libsox_le16(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8;
+}
+
+static inline uint32_t libsox_le32(const unsigned char *p)
+{
+  return libsox_le16(p) | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t libsox_le64(const unsigned char *p)
+{
+  return libsox_le32(p) | (uint64_t)libsox_le32(p + 4) << 32;
+}
+
+static inline void libsox_put_le32(unsigned char *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+static inline void libsox_put_le64(unsigned char *p, uint64_t v)
+{
+  libsox_put_le32(p, (uint32_t)v);
+  libsox_put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+// 1 if file_name is a regular file and could be mapped
+static int libsox_map(const char *file_name, libsox_map_t *m)
+{
+#if LIBSOX_HAVE_MMAP
+  struct stat st;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return 0;
+  }
+  void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return 0;
+  m->base = (const unsigned char *)base;
+  m->size = (size_t)st.st_size;
+  return 1;
+#else
+  (void)file_name;
+  (void)m;
+  return 0;
+#endif
+}
+
+static void libsox_unmap(libsox_map_t *m)
+{
+#if LIBSOX_HAVE_MMAP
+  munmap((void *)m->base, m->size);
+#endif
+}
+
+// Tell the kernel that size bytes at p are about to be read once, in order
+static void libsox_map_advise(const libsox_map_t *m, const unsigned char *p, size_t size)
+{
+#if LIBSOX_HAVE_MMAP && defined(MADV_SEQUENTIAL)
+  long page = sysconf(_SC_PAGESIZE);
+  size_t start = (size_t)(p - m->base);
+  size_t aligned = page > 0 ? start - start % (size_t)page : start;
+  madvise((void *)(m->base + aligned), size + (start - aligned), MADV_SEQUENTIAL);
+#else
+  (void)m;
+  (void)p;
+  (void)size;
+#endif
+}
+
+// 1 if m holds a RIFF WAVE file of 8, 16, 24 or 32 bit integer PCM (plain
+// or WAVE_FORMAT_EXTENSIBLE), with w filled in. A data chunk that claims
+// more than the file holds (truncated or still being written) is cut to
+// what is there, and a trailing partial frame is dropped, as libsox does.
+static int libsox_wav_parse(const libsox_map_t *m, libsox_wav_t *w)
+{
+  // KSDATAFORMAT_SUBTYPE_PCM, after its first two bytes
+  static const unsigned char pcm_guid[14] =
+    {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+  const unsigned char *p = m->base;
+  size_t pos = 12;
+  int have_fmt = 0;
+  if (m->size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+    return 0;
+  while (pos + 8 <= m->size) {
+    const unsigned char *chunk = p + pos;
+    size_t size = libsox_le32(chunk + 4);
+    pos += 8;
+    if (!memcmp(chunk, "fmt ", 4)) {
+      const unsigned char *f = p + pos;
+      if (size < 16 || size > m->size - pos)
+        return 0;
+      uint32_t format = libsox_le16(f);
+      uint32_t align = libsox_le16(f + 12), bits = libsox_le16(f + 14);
+      if (format == 0xFFFE) {
+        if (size < 40 || libsox_le16(f + 18) != bits || libsox_le16(f + 24) != 1
+            || memcmp(f + 26, pcm_guid, sizeof(pcm_guid)))
+          return 0;
+      } else if (format != 1) {
+        return 0;
+      }
+      w->channels = libsox_le16(f + 2);
+      w->rate = libsox_le32(f + 4);
+      if (w->channels == 0 || w->rate == 0
+          || (bits != 8 && bits != 16 && bits != 24 && bits != 32)
+          || align != w->channels * bits / 8)
+        return 0;
+      w->bytes = bits / 8;
+      have_fmt = 1;
+    } else if (!memcmp(chunk, "data", 4)) {
+      if (!have_fmt)
+        return 0;
+      if (size > m->size - pos)
+        size = m->size - pos;
+      w->data = pos;
+      w->nframes = size / (w->channels * w->bytes);
+      return 1;
+    }
+    if (size > m->size - pos)
+      return 0;
+    pos += size + (size & 1);
+  }
+  return 0;
+}
+
+// n samples of a WAV data chunk as sox samples, scaled as libsox scales them
+static void libsox_wav_samples(const unsigned char *src, int bytes, size_t n,
+                               sox_sample_t *dst)
+{
+  size_t i = 0;
+  switch (bytes) {
+  case 1:
+    for (; i < n; i++)
+      dst[i] = (sox_sample_t)((uint32_t)(src[i] ^ 0x80) << 24);
+    break;
+  case 2:
+#if defined(__SSE2__)
+    // x86 is little-endian: interleaving zeros below each sample is the shift
+    for (; i + 8 <= n; i += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(_mm_setzero_si128(), v));
+      _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(_mm_setzero_si128(), v));
+    }
+#endif
+    for (; i < n; i++)
+      dst[i] = (sox_sample_t)(libsox_le16(src + 2 * i) << 16);
+    break;
+  case 3:
+    for (; i < n; i++)
+      dst[i] = (sox_sample_t)(libsox_le16(src + 3 * i) << 8 | (uint32_t)src[3 * i + 2] << 24);
+    break;
+  default:
+    for (; i < n; i++)
+      dst[i] = (sox_sample_t)libsox_le32(src + 4 * i);
+    break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// In-memory blobs (audio.decompress, loadBatch).
+// compress used to write an int64 sample count before the encoded bytes,
+// as a length hint; it now returns the encoder's bytes untouched, so that
+// its output is an ordinary file and ordinary files can be decompressed.
+// Blobs with the old prefix are still recognised: by the signature after
+// it, or, for formats without one, only when options.legacy says so.
+
+// 1 if p (n bytes) starts with the signature of a format libsox can read
+// from memory
+static int libsox_sniff(const unsigned char *p, size_t n)
+{
+  static const char *magic[] = {"RIFF", "RIFX", "RF64", "fLaC", "OggS", "ID3",
+                                "FORM", ".snd", "caff", "#!AMR", ".SoX", "XoS.",
+                                "wvpk", NULL};
+  int i;
+  for (i = 0; magic[i]; i++)
+    if (n >= strlen(magic[i]) && !memcmp(p, magic[i], strlen(magic[i])))
+      return 1;
+  // MPEG audio or ADTS frame sync
+  return n >= 2 && p[0] == 0xFF && (p[1] & 0xE0) == 0xE0;
+}
+
+// 1 if files with this extension start with one of libsox_sniff's
+// signatures
+static int libsox_signed_format(const char *extension)
+{
+  static const char *signed_formats[] = {"wav", "wave", "rf64", "flac", "ogg", "oga",
+                                         "opus", "vorbis", "mp3", "mp2", "aiff", "aif",
+                                         "aifc", "au", "snd", "caf", "amr-nb", "amr-wb",
+                                         "sox", "wv", NULL};
+  char ext[8];
+  size_t i, n = extension ? strlen(extension) : 0;
+  if (n == 0 || n >= sizeof(ext))
+    return 0;
+  for (i = 0; i <= n; i++)
+    ext[i] = (char)tolower((unsigned char)extension[i]);
+  for (i = 0; signed_formats[i]; i++)
+    if (!strcmp(ext, signed_formats[i]))
+      return 1;
+  return 0;
+}
+
+// Bytes of old-style length prefix at the start of a blob: 8, with *length
+// set to the sample count, or 0. A signature right after the first 8
+// bytes means a prefix, and is tested first, since a count can itself
+// look like a signature (an MPEG frame sync, say). A signature at the
+// start means none. For formats without a signature (raw PCM and the
+// like) a prefix looks like any 8 bytes of samples, so a plausible count
+// is only taken for one when the caller says the blob is old (legacy).
+static size_t libsox_legacy_prefix(const unsigned char *p, size_t n, const char *extension,
+                                   int legacy, int64_t *length)
+{
+  uint64_t v;
+  if (n < 8)
+    return 0;
+  v = libsox_le64(p);
+  if (!libsox_sniff(p + 8, n - 8)) {
+    if (libsox_sniff(p, n) || !legacy || libsox_signed_format(extension)
+        || v == 0 || v >= ((uint64_t)1 << 40))
+      return 0;
+  }
+  *length = (int64_t)v;
+  return 8;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Effects chains (options.effects, audio.applyEffects).
+// Samples flow from a source effect, through the libsox effects the options
+// name, into a sink effect that converts them into the output tensor as
+// they arrive (generic/sox.c), so the chain runs in one streaming pass and
+// nothing but the output is held at full length. The source reads a
+// decoder, or quantizes a tensor (generic/sox.c).
+
+static LIBSOX_THREAD_LOCAL char libsox_effects_error[256];
+
+// A source (or sink) effect with the given handler, whose priv is ctx
+static sox_effect_t *libsox_effect(const sox_effect_handler_t *handler, void *ctx)
+{
+  sox_effect_t *e = sox_create_effect(handler);
+  if (e)
+    *(void **)e->priv = ctx;
+  return e;
+}
+
+// Free an effect that did not make it into a chain. sox_add_effect copies
+// an effect it accepts, priv included, so after success only e itself is
+// the caller's to free; after failure, or before adding, priv is too.
+static void libsox_effect_free(sox_effect_t *e)
+{
+  if (e) {
+    free(e->priv);
+    free(e);
+  }
+}
+
+// Add effect name with its nargs arguments to chain. signal is what enters
+// it, and is updated to what leaves it. Returns NULL or an error.
+static const char *libsox_add_effect(sox_effects_chain_t *chain, const char *name,
+                                     int nargs, char **args, sox_signalinfo_t *signal)
+{
+  const sox_effect_handler_t *handler = sox_find_effect(name);
+  if (handler == NULL) {
+    snprintf(libsox_effects_error, sizeof(libsox_effects_error),
+             "[effects] unknown effect %s", name);
+    return libsox_effects_error;
+  }
+  sox_effect_t *e = sox_create_effect(handler);
+  if (e == NULL)
+    return "[effects] Failure to create effect";
+  if (sox_effect_options(e, nargs, args) != SOX_SUCCESS) {
+    libsox_effect_free(e);
+    snprintf(libsox_effects_error, sizeof(libsox_effects_error),
+             "[effects] wrong arguments for effect %s", name);
+    return libsox_effects_error;
+  }
+  if (sox_add_effect(chain, e, signal, signal) != SOX_SUCCESS) {
+    libsox_effect_free(e);
+    snprintf(libsox_effects_error, sizeof(libsox_effects_error),
+             "[effects] effect %s cannot be used here", name);
+    return libsox_effects_error;
+  }
+  free(e);
+  return NULL;
+}
+
+// Add the effects of fx to chain, then libsox's rate effect when rate is
+// set and differs from the rate they produce (speed, for one, changes it).
+// Returns NULL or an error.
+static const char *libsox_add_effects(sox_effects_chain_t *chain, const libsox_effects_t *fx,
+                                      long rate, sox_signalinfo_t *signal)
+{
+  char *args[LIBSOX_MAX_EFFECT_WORDS];
+  char text[32];
+  const char *err;
+  int i, j;
+  for (i = 0; i < fx->n; i++) {
+    for (j = 1; j < fx->nwords[i]; j++)
+      args[j - 1] = (char *)fx->text + fx->word[i][j];
+    err = libsox_add_effect(chain, fx->text + fx->word[i][0], fx->nwords[i] - 1, args, signal);
+    if (err)
+      return err;
+  }
+  if (rate && rate != (long)floor(signal->rate + 0.5)) {
+    snprintf(text, sizeof(text), "%ld", rate);
+    args[0] = text;
+    return libsox_add_effect(chain, "rate", 1, args, signal);
+  }
+  return NULL;
+}
+
+// Source reading whole frames from a decoder, at most left samples
+typedef struct {
+  sox_format_t *fd;
+  size_t left;
+} libsox_fd_source_t;
+
+static int libsox_fd_source_drain(sox_effect_t *effp, sox_sample_t *obuf, size_t *osamp)
+{
+  libsox_fd_source_t *s = *(libsox_fd_source_t **)effp->priv;
+  size_t n = *osamp - *osamp % s->fd->signal.channels;
+  if (n > s->left)
+    n = s->left;
+  n = n ? libsox_read_frames(s->fd, obuf, n) : 0;
+  s->left -= n;
+  *osamp = n;
+  return n ? SOX_SUCCESS : SOX_EOF;
+}
+
+static const sox_effect_handler_t libsox_fd_source = {
+  "decoder", NULL, SOX_EFF_MCHAN | SOX_EFF_MODIFY,
+  NULL, NULL, NULL, libsox_fd_source_drain, NULL, NULL, sizeof(void *)
+};
+
+// End of effects chains section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Streaming decoder handle (audio.stream).
+// Keeps a sox_format_t open between reads and owns one staging buffer of
+// chunk_frames * channels samples, so memory stays bounded by the chunk size
+// and not by the length of the file.
+#define LIBSOX_STREAM "libsox.Stream"
+
+typedef struct {
+  sox_format_t *fd;
+  sox_sample_t *buffer;
+  size_t chunk_frames;
+  size_t consumed;   // samples handed out so far
+  libsox_read_opts_t opts;
+} libsox_stream_t;
+
+static libsox_stream_t *libsox_checkstream(lua_State *L, int idx)
+{
+  return (libsox_stream_t *)luaL_checkudata(L, idx, LIBSOX_STREAM);
+}
+
+static void libsox_stream_close(libsox_stream_t *s)
+{
+  if (s->fd)
+    sox_close(s->fd);
+  free(s->buffer);
+  s->fd = NULL;
+  s->buffer = NULL;
+}
+
+// arguments [filename, chunk-frames, options]
+static int libsox_stream_open(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  long chunk_frames = luaL_checklong(L, 2);
+  if (chunk_frames <= 0)
+    luaL_error(L, "[stream_open] chunk_frames should be positive");
+
+  libsox_stream_t *s = (libsox_stream_t *)lua_newuserdata(L, sizeof(libsox_stream_t));
+  s->fd = NULL;
+  s->buffer = NULL;
+  s->chunk_frames = chunk_frames;
+  s->consumed = 0;
+  libsox_check_read_opts(L, 3, &s->opts);
+  if (s->opts.rate)
+    luaL_error(L, "[stream_open] rate is not supported when streaming");
+  if (s->opts.effects.n)
+    luaL_error(L, "[stream_open] effects are not supported when streaming");
+  luaL_getmetatable(L, LIBSOX_STREAM);
+  lua_setmetatable(L, -2);
+
+  s->fd = sox_open_read(filename, NULL, NULL, NULL);
+  if (s->fd == NULL)
+    luaL_error(L, "[stream_open] Failure to read file");
+  s->buffer = (sox_sample_t *)malloc(sizeof(sox_sample_t) * chunk_frames
+                                     * s->fd->signal.channels);
+  if (s->buffer == NULL)
+    luaL_error(L, "[stream_open] Failure to allocate staging buffer");
+  const char *err = libsox_check_channels(s->fd->signal.channels, &s->opts);
+  if (err)
+    luaL_error(L, "%s", err);
+  libsox_skip(s->fd, s->opts.offset);
+  return 1;
+}
+
+// Fill the staging buffer with up to chunk_frames frames. sox_read may return
+// short counts before the end of the file, so loop until the chunk is full.
+static size_t libsox_stream_fill(libsox_stream_t *s)
+{
+  if (s->fd == NULL)
+    return 0;
+  size_t nchannels = s->fd->signal.channels;
+  size_t wanted = s->chunk_frames * nchannels;
+  size_t got = 0;
+  if (s->opts.length) {
+    // stream only the requested window
+    size_t left = s->opts.length * nchannels - s->consumed;
+    if (left < wanted)
+      wanted = left;
+  }
+  while (got < wanted) {
+    size_t n = sox_read(s->fd, s->buffer + got, wanted - got);
+    if (n == 0)
+      break;
+    got += n;
+  }
+  s->consumed += got;
+  return got / nchannels;
+}
+
+static int libsox_stream_gc(lua_State *L)
+{
+  libsox_stream_close(libsox_checkstream(L, 1));
+  return 0;
+}
+
+static int libsox_stream_rate(lua_State *L)
+{
+  libsox_stream_t *s = libsox_checkstream(L, 1);
+  lua_pushnumber(L, s->fd ? s->fd->signal.rate : 0);
+  return 1;
+}
+
+static int libsox_stream_channels(lua_State *L)
+{
+  libsox_stream_t *s = libsox_checkstream(L, 1);
+  lua_pushnumber(L, s->fd ? s->fd->signal.channels : 0);
+  return 1;
+}
+
+// total number of frames, or 0 if the format does not know it up front
+static int libsox_stream_length(lua_State *L)
+{
+  libsox_stream_t *s = libsox_checkstream(L, 1);
+  double length = 0;
+  if (s->fd && s->fd->signal.channels)
+    length = (double)(s->fd->signal.length / s->fd->signal.channels);
+  lua_pushnumber(L, length);
+  return 1;
+}
+
+static const luaL_Reg libsox_stream__[] =
+{
+  {"close", libsox_stream_gc},
+  {"rate", libsox_stream_rate},
+  {"channels", libsox_stream_channels},
+  {"length", libsox_stream_length},
+  {NULL, NULL}
+};
+
+// End of streaming decoder section
+////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////
+// Clip archives (audio.ArchiveWriter, audio.Archive).
+// Many encoded clips in one file, followed by an index, so that a dataset
+// of short clips is one file rather than millions:
+//
+//   header   "TAUDARC1", the extension of every clip (8 bytes, NUL padded),
+//            then the end of the last trailer written (uint64, 0 if none)
+//   clips    the bytes compress would produce for each clip, back to back
+//   index    one 32 byte entry per clip: offset, size, length (frames),
+//            all uint64, then sample rate and channels, uint32
+//   trailer  offset of the index and number of clips (uint64), "TAUDIDX1"
+//
+// All integers are little-endian. The file only ever grows: a writer adds
+// clips after its end, past the index of an earlier session, and on close
+// writes a new index and trailer there, and only then points the header
+// at them. Until that last 8 byte write, readers (and a writer reopening
+// the file after a crash) find the previous trailer through the header,
+// in one step, and see the archive as it was last closed. A never closed
+// archive is empty. The reader maps the file and hands each clip's bytes
+// to sox_open_mem_read in place.
+//
+// Every session writes the whole index again and leaves the previous one
+// behind as dead space, as are the clips of a session that never closed.
+// archive_compact copies the live clips into a new file with one index.
+#define LIBSOX_ARCHIVE "libsox.Archive"
+#define LIBSOX_ARCHIVE_WRITER "libsox.ArchiveWriter"
+#define LIBSOX_ARCHIVE_MAGIC "TAUDARC1"
+#define LIBSOX_ARCHIVE_INDEX_MAGIC "TAUDIDX1"
+#define LIBSOX_ARCHIVE_HEADER 24
+#define LIBSOX_ARCHIVE_ENTRY 32
+#define LIBSOX_ARCHIVE_TRAILER 24
+
+// 64 bit file offsets, archives can outgrow a long
+#if defined(_WIN32)
+#define libsox_fseek(f, offset, whence) _fseeki64(f, (__int64)(offset), whence)
+#define libsox_ftell(f) ((int64_t)_ftelli64(f))
+#else
+#define libsox_fseek(f, offset, whence) fseeko(f, (off_t)(offset), whence)
+#define libsox_ftell(f) ((int64_t)ftello(f))
+#endif
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t length;
+  uint32_t rate;
+  uint32_t channels;
+} libsox_archive_entry_t;
+
+typedef struct {
+  FILE *f;
+  char extension[9];
+  libsox_archive_entry_t *entries;
+  size_t count, cap;
+  uint64_t end;          // where the next clip goes, and then the index
+  int dirty;             // the file needs a new index
+} libsox_archive_writer_t;
+
+typedef struct {
+  libsox_map_t m;
+  int open;
+  char extension[9];
+  const unsigned char *index;
+  size_t count;
+  uint64_t index_offset;
+} libsox_archive_t;
+
+static libsox_archive_writer_t *libsox_checkwriter(lua_State *L, int idx)
+{
+  return (libsox_archive_writer_t *)luaL_checkudata(L, idx, LIBSOX_ARCHIVE_WRITER);
+}
+
+static libsox_archive_t *libsox_checkarchive(lua_State *L, int idx)
+{
+  return (libsox_archive_t *)luaL_checkudata(L, idx, LIBSOX_ARCHIVE);
+}
+
+// header of a new archive, which has no trailer yet
+static void libsox_archive_header(unsigned char *header, const char *extension)
+{
+  memset(header, 0, LIBSOX_ARCHIVE_HEADER);
+  memcpy(header, LIBSOX_ARCHIVE_MAGIC, 8);
+  memcpy(header + 8, extension, strlen(extension));
+}
+
+// NULL if the last LIBSOX_ARCHIVE_TRAILER of size bytes are a valid trailer,
+// whose index offset and clip count are returned
+static const char *libsox_archive_trailer(const unsigned char *trailer, uint64_t size,
+                                          uint64_t *index_offset, uint64_t *count)
+{
+  if (memcmp(trailer + 16, LIBSOX_ARCHIVE_INDEX_MAGIC, 8))
+    return "[archive] corrupt archive index";
+  *index_offset = libsox_le64(trailer);
+  *count = libsox_le64(trailer + 8);
+  if (*index_offset < LIBSOX_ARCHIVE_HEADER
+      || *count > (size - LIBSOX_ARCHIVE_TRAILER) / LIBSOX_ARCHIVE_ENTRY
+      || *index_offset + *count * LIBSOX_ARCHIVE_ENTRY + LIBSOX_ARCHIVE_TRAILER != size)
+    return "[archive] corrupt archive index";
+  return NULL;
+}
+
+// Find the trailer the header of the archive mapped at base points to,
+// the last one a writer closed (see above). An archive that was never
+// closed has no clips.
+static const char *libsox_archive_find(const unsigned char *base, uint64_t size,
+                                       uint64_t *index_offset, uint64_t *count)
+{
+  uint64_t end = libsox_le64(base + 16);
+  if (end == 0) {
+    *index_offset = LIBSOX_ARCHIVE_HEADER;
+    *count = 0;
+    return NULL;
+  }
+  if (end < LIBSOX_ARCHIVE_HEADER + LIBSOX_ARCHIVE_TRAILER || end > size)
+    return "[archive] corrupt archive header";
+  return libsox_archive_trailer(base + end - LIBSOX_ARCHIVE_TRAILER, end,
+                                index_offset, count);
+}
+
+static void libsox_archive_unpack(const unsigned char *p, libsox_archive_entry_t *e)
+{
+  e->offset = libsox_le64(p);
+  e->size = libsox_le64(p + 8);
+  e->length = libsox_le64(p + 16);
+  e->rate = libsox_le32(p + 24);
+  e->channels = libsox_le32(p + 28);
+}
+
+// Write the index and trailer after the last clip, if clips were added,
+// point the header at them and close the file. Returns 0 if a write failed,
+// in which case the header still points at the previous trailer.
+static int libsox_archive_finish(libsox_archive_writer_t *w)
+{
+  unsigned char buf[LIBSOX_ARCHIVE_ENTRY];
+  size_t i;
+  if (!w->dirty) {
+    int ok = fclose(w->f) == 0;
+    w->f = NULL;
+    return ok;
+  }
+  int ok = libsox_fseek(w->f, w->end, SEEK_SET) == 0;
+  for (i = 0; ok && i < w->count; i++) {
+    const libsox_archive_entry_t *e = &w->entries[i];
+    libsox_put_le64(buf, e->offset);
+    libsox_put_le64(buf + 8, e->size);
+    libsox_put_le64(buf + 16, e->length);
+    libsox_put_le32(buf + 24, e->rate);
+    libsox_put_le32(buf + 28, e->channels);
+    ok = fwrite(buf, 1, LIBSOX_ARCHIVE_ENTRY, w->f) == LIBSOX_ARCHIVE_ENTRY;
+  }
+  libsox_put_le64(buf, w->end);
+  libsox_put_le64(buf + 8, w->count);
+  memcpy(buf + 16, LIBSOX_ARCHIVE_INDEX_MAGIC, 8);
+  ok = ok && fwrite(buf, 1, LIBSOX_ARCHIVE_TRAILER, w->f) == LIBSOX_ARCHIVE_TRAILER;
+  // the index must be in the file before the header points at it
+  ok = ok && fflush(w->f) == 0;
+  libsox_put_le64(buf, w->end + w->count * LIBSOX_ARCHIVE_ENTRY + LIBSOX_ARCHIVE_TRAILER);
+  ok = ok && libsox_fseek(w->f, 16, SEEK_SET) == 0 && fwrite(buf, 1, 8, w->f) == 8;
+  ok = fclose(w->f) == 0 && ok;
+  w->f = NULL;
+  return ok;
+}
+
+static void libsox_writer_release(libsox_archive_writer_t *w)
+{
+  if (w->f)
+    libsox_archive_finish(w);
+  free(w->entries);
+  w->entries = NULL;
+}
+
+// Append size encoded bytes as the next clip. Returns NULL or an error.
+static const char *libsox_archive_append(libsox_archive_writer_t *w, const char *data,
+                                         size_t size, long length, int rate, long channels)
+{
+  if (w->count == w->cap) {
+    size_t cap = w->cap ? 2 * w->cap : 64;
+    libsox_archive_entry_t *entries = (libsox_archive_entry_t *)
+      realloc(w->entries, sizeof(libsox_archive_entry_t) * cap);
+    if (entries == NULL)
+      return "[archive_add] Failure to grow the index";
+    w->entries = entries;
+    w->cap = cap;
+  }
+  if (libsox_fseek(w->f, w->end, SEEK_SET) != 0
+      || fwrite(data, 1, size, w->f) != size)
+    return "[archive_add] Failure to write clip";
+  libsox_archive_entry_t *e = &w->entries[w->count++];
+  e->offset = w->end;
+  e->size = size;
+  e->length = length;
+  e->rate = rate;
+  e->channels = channels;
+  w->end += size;
+  w->dirty = 1;
+  return NULL;
+}
+
+// Open filename to add clips to: the index of an existing archive is read
+// back, and new clips go after the end of the file, so that nothing a
+// reader may be using is overwritten. A missing or empty file is created.
+// Returns NULL or an error.
+static const char *libsox_archive_reopen(libsox_archive_writer_t *w, const char *filename)
+{
+  unsigned char header[LIBSOX_ARCHIVE_HEADER];
+  uint64_t index_offset, count, i;
+  libsox_map_t m;
+  const char *err = NULL;
+  libsox_archive_header(header, w->extension);
+
+  w->f = fopen(filename, "r+b");
+  if (w->f == NULL || libsox_fseek(w->f, 0, SEEK_END) != 0 || libsox_ftell(w->f) <= 0) {
+    if (w->f)
+      fclose(w->f);
+    w->f = fopen(filename, "w+b");
+    if (w->f == NULL)
+      return "[archive_create] Failure to create file";
+    // flushed now, so that readers see an empty archive rather than no file
+    if (fwrite(header, 1, LIBSOX_ARCHIVE_HEADER, w->f) != LIBSOX_ARCHIVE_HEADER
+        || fflush(w->f) != 0)
+      err = "[archive_create] Failure to create file";
+    w->end = LIBSOX_ARCHIVE_HEADER;
+    w->dirty = 1;
+  } else if (!libsox_map(filename, &m)) {
+    err = "[archive_create] Failure to read the index";
+  } else {
+    if (m.size < LIBSOX_ARCHIVE_HEADER || memcmp(m.base, LIBSOX_ARCHIVE_MAGIC, 8))
+      err = "[archive_create] existing file is not a clip archive";
+    else if (memcmp(m.base + 8, header + 8, 8))
+      err = "[archive_create] existing archive holds clips of another extension";
+    else
+      err = libsox_archive_find(m.base, m.size, &index_offset, &count);
+    if (err == NULL) {
+      w->cap = count > 64 ? count : 64;
+      w->entries = (libsox_archive_entry_t *)malloc(sizeof(libsox_archive_entry_t) * w->cap);
+      if (w->entries == NULL)
+        err = "[archive_create] Failure to read the index";
+      for (i = 0; err == NULL && i < count; i++)
+        libsox_archive_unpack(m.base + index_offset + i * LIBSOX_ARCHIVE_ENTRY,
+                              &w->entries[w->count++]);
+      w->end = m.size;
+    }
+    libsox_unmap(&m);
+  }
+  if (err) {
+    // leave the file as it was
+    fclose(w->f);
+    w->f = NULL;
+  }
+  return err;
+}
+
+// arguments [filename, extension]. An archive that already exists is
+// appended to, and must hold clips of the same extension.
+static int libsox_archive_create(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  const char *extension = luaL_checkstring(L, 2);
+  if (strlen(extension) == 0 || strlen(extension) > 8)
+    luaL_error(L, "[archive_create] extension should be 1 to 8 characters");
+
+  libsox_archive_writer_t *w = (libsox_archive_writer_t *)
+    lua_newuserdata(L, sizeof(libsox_archive_writer_t));
+  memset(w, 0, sizeof(libsox_archive_writer_t));
+  strcpy(w->extension, extension);
+  luaL_getmetatable(L, LIBSOX_ARCHIVE_WRITER);
+  lua_setmetatable(L, -2);
+  const char *err = libsox_archive_reopen(w, filename);
+  if (err)
+    luaL_error(L, "%s", err);
+  return 1;
+}
+
+static int libsox_writer_gc(lua_State *L)
+{
+  libsox_writer_release(libsox_checkwriter(L, 1));
+  return 0;
+}
+
+static int libsox_writer_close(lua_State *L)
+{
+  libsox_archive_writer_t *w = libsox_checkwriter(L, 1);
+  int ok = w->f == NULL || libsox_archive_finish(w);
+  libsox_writer_release(w);
+  if (!ok)
+    luaL_error(L, "[archive_close] Failure to write the index");
+  return 0;
+}
+
+static int libsox_writer_size(lua_State *L)
+{
+  lua_pushnumber(L, (double) libsox_checkwriter(L, 1)->count);
+  return 1;
+}
+
+// Map an archive for reading. Returns NULL or an error; a->open says
+// whether there is a mapping to release either way.
+static const char *libsox_archive_map(libsox_archive_t *a, const char *filename)
+{
+  uint64_t index_offset, count;
+  if (!libsox_map(filename, &a->m))
+    return "[archive_open] Failure to map file";
+  a->open = 1;
+  if (a->m.size < LIBSOX_ARCHIVE_HEADER || memcmp(a->m.base, LIBSOX_ARCHIVE_MAGIC, 8))
+    return "[archive_open] not a clip archive";
+  const char *err = libsox_archive_find(a->m.base, a->m.size, &index_offset, &count);
+  if (err)
+    return err;
+  memcpy(a->extension, a->m.base + 8, 8);
+  a->extension[8] = 0;
+  a->index = a->m.base + index_offset;
+  a->count = count;
+  a->index_offset = index_offset;
+  return NULL;
+}
+
+// arguments [filename]
+static int libsox_archive_open(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  libsox_archive_t *a = (libsox_archive_t *)lua_newuserdata(L, sizeof(libsox_archive_t));
+  memset(a, 0, sizeof(libsox_archive_t));
+  luaL_getmetatable(L, LIBSOX_ARCHIVE);
+  lua_setmetatable(L, -2);
+  const char *err = libsox_archive_map(a, filename);
+  if (err)
+    luaL_error(L, "%s", err);
+  return 1;
+}
+
+// Entry of clip i (0-based). Returns NULL or an error.
+static const char *libsox_archive_entry(const libsox_archive_t *a, long i,
+                                        libsox_archive_entry_t *e)
+{
+  if (!a->open)
+    return "[archive] archive is closed";
+  if (i < 0 || (size_t)i >= a->count)
+    return "[archive] clip index out of range";
+  libsox_archive_unpack(a->index + (size_t)i * LIBSOX_ARCHIVE_ENTRY, e);
+  if (e->offset < LIBSOX_ARCHIVE_HEADER || e->offset > a->index_offset
+      || e->size > a->index_offset - e->offset || e->channels == 0)
+    return "[archive] corrupt archive index";
+  return NULL;
+}
+
+static int libsox_archive_gc(lua_State *L)
+{
+  libsox_archive_t *a = libsox_checkarchive(L, 1);
+  if (a->open)
+    libsox_unmap(&a->m);
+  a->open = 0;
+  a->count = 0;
+  return 0;
+}
+
+static int libsox_archive_size(lua_State *L)
+{
+  lua_pushnumber(L, (double) libsox_checkarchive(L, 1)->count);
+  return 1;
+}
+
+// arguments [archive, index (1-based)]; returns [length, sample rate, channels]
+static int libsox_archive_info(lua_State *L)
+{
+  libsox_archive_t *a = libsox_checkarchive(L, 1);
+  libsox_archive_entry_t e;
+  const char *err = libsox_archive_entry(a, luaL_checklong(L, 2) - 1, &e);
+  if (err)
+    luaL_error(L, "%s", err);
+  lua_pushnumber(L, (double) e.length);
+  lua_pushnumber(L, (double) e.rate);
+  lua_pushnumber(L, (double) e.channels);
+  return 3;
+}
+
+// arguments [filename, output filename]
+// returns [bytes reclaimed]. Copies the clips of the archive, as it was
+// last closed, back to back into a new archive at output, with one index,
+// leaving behind the dead space of earlier sessions (see above). Readers
+// of the original are not disturbed.
+static int libsox_archive_compact(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  const char *output = luaL_checkstring(L, 2);
+  libsox_archive_t a;
+  libsox_archive_writer_t w;
+  libsox_archive_entry_t e;
+  size_t i;
+  int ok = 1;
+  memset(&a, 0, sizeof(a));
+  memset(&w, 0, sizeof(w));
+  if (strcmp(filename, output) == 0)
+    luaL_error(L, "[archive_compact] output should be another file");
+  const char *err = libsox_archive_map(&a, filename);
+  if (err == NULL) {
+    strcpy(w.extension, a.extension);
+    // start from an empty file, not append to whatever is there
+    remove(output);
+    err = libsox_archive_reopen(&w, output);
+  }
+  for (i = 0; err == NULL && i < a.count; i++) {
+    err = libsox_archive_entry(&a, i, &e);
+    if (err == NULL)
+      err = libsox_archive_append(&w, (const char *)a.m.base + e.offset, e.size,
+                                  e.length, e.rate, e.channels);
+  }
+  if (w.f)
+    ok = libsox_archive_finish(&w);
+  double reclaimed = (double)a.m.size - (double)(w.end + w.count * LIBSOX_ARCHIVE_ENTRY
+                                                 + LIBSOX_ARCHIVE_TRAILER);
+  libsox_writer_release(&w);
+  if (a.open)
+    libsox_unmap(&a.m);
+  if (err == NULL && !ok)
+    err = "[archive_compact] Failure to write the index";
+  if (err)
+    luaL_error(L, "%s", err);
+  lua_pushnumber(L, reclaimed);
+  return 1;
+}
+
+static const luaL_Reg libsox_writer__[] =
+{
+  {"close", libsox_writer_close},
+  {"size", libsox_writer_size},
+  {NULL, NULL}
+};
+
+static const luaL_Reg libsox_archive__[] =
+{
+  {"close", libsox_archive_gc},
+  {"size", libsox_archive_size},
+  {"info", libsox_archive_info},
+  {NULL, NULL}
+};
+// End of clip archive section
+////////////////////////////////////////////////////////////////////////////
+
+static const luaL_Reg libsox__[] =
+{
+  {"stream_open", libsox_stream_open},
+  {"archive_create", libsox_archive_create},
+  {"archive_open", libsox_archive_open},
+  {"archive_compact", libsox_archive_compact},
+  {NULL, NULL}
+};
+
+#include "generic/resample.c"
+#include "THGenerateAllTypes.h"
+
 #include "generic/sox.c"
 #include "THGenerateAllTypes.h"
 
@@ -40,9 +1444,34 @@ DLL_EXPORT int luaopen_libsox(lua_State *L)
   libsox_FloatMain_init(L);
   libsox_DoubleMain_init(L);
 
+  luaL_newmetatable(L, LIBSOX_STREAM);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, libsox_stream_gc);
+  lua_setfield(L, -2, "__gc");
+  luaT_setfuncs(L, libsox_stream__, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LIBSOX_ARCHIVE_WRITER);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, libsox_writer_gc);
+  lua_setfield(L, -2, "__gc");
+  luaT_setfuncs(L, libsox_writer__, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LIBSOX_ARCHIVE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, libsox_archive_gc);
+  lua_setfield(L, -2, "__gc");
+  luaT_setfuncs(L, libsox_archive__, 0);
+  lua_pop(L, 1);
+
   lua_newtable(L);
   lua_pushvalue(L, -1);
   lua_setglobal(L, "libsox");
+  luaT_setfuncs(L, libsox__, 0);
 
   lua_newtable(L);
   luaT_setfuncs(L, libsox_DoubleMain__, 0);
@@ -0,0 +1,5 @@
+require 'audio'
+-- th test/benchmark.lua [report.json] [seconds]
+-- runs audio.benchmark with its defaults; the JSON report goes to the
+-- given file, or to stdout
+audio.benchmark{output = arg[1], seconds = tonumber(arg[2]) or 30}
@@ -0,0 +1,83 @@
+require 'audio'
+-- clips written to an archive, in two sessions, come back in order
+local file = os.tmpname() .. '.arc'
+os.remove(file)
+local function clip(n, c, k)
+   return torch.range(1, n * c):mul(0.01 * k):sin():mul(2^28):view(n, c)
+end
+local w = audio.ArchiveWriter(file, 'flac')
+for k = 1, 3 do
+   assert(w:add(clip(1000 * k, k % 2 + 1, k), 16000) == k)
+end
+w:close()
+w = audio.ArchiveWriter(file, 'flac')
+assert(w:size() == 3 and w:add(clip(500, 1, 4), 8000) == 4)
+w:close()
+
+local r = audio.Archive(file)
+assert(r:size() == 4)
+for k = 1, 4 do
+   local length, rate, channels = r:info(k)
+   local x = k < 4 and clip(1000 * k, k % 2 + 1, k) or clip(500, 1, 4)
+   local y, sample_rate = r:get(k)
+   assert(length == x:size(1) and channels == x:size(2) and sample_rate == rate)
+   assert(y:size(1) == x:size(1) and y:size(2) == x:size(2))
+   -- flac keeps the 16 bit samples, so the error is below one step
+   assert((y - x):abs():max() <= 2^16, 'clip ' .. k .. ' differs')
+end
+local s = r:get(2, {type = 'torch.ShortTensor', offset = 10, length = 20})
+assert(s:size(1) == 20)
+r:close()
+
+-- clips added in a later session do not disturb readers, opened before the
+-- session or during it, until the writer is closed
+local before = audio.Archive(file)
+w = audio.ArchiveWriter(file, 'flac')
+w:add(clip(300, 2, 5), 16000)
+local during = audio.Archive(file)
+assert(before:size() == 4 and during:size() == 4)
+for k = 1, 4 do
+   local x = k < 4 and clip(1000 * k, k % 2 + 1, k) or clip(500, 1, 4)
+   for _, a in ipairs({before, during}) do
+      assert((a:get(k) - x):abs():max() <= 2^16, 'clip ' .. k .. ' differs while appending')
+   end
+end
+w:close()
+assert((before:get(2) - clip(2000, 1, 2)):abs():max() <= 2^16)
+before:close()
+during:close()
+r = audio.Archive(file)
+assert(r:size() == 5 and r:info(5) == 300)
+
+-- compaction drops the index of every earlier session, and keeps the clips
+local function filesize(path)
+   local f = io.open(path, 'rb')
+   local size = f:seek('end')
+   f:close()
+   return size
+end
+local size = filesize(file)
+local reclaimed = audio.compactArchive(file)
+assert(reclaimed > 0 and filesize(file) == size - reclaimed)
+local c = audio.Archive(file)
+assert(c:size() == 5)
+for k = 1, 5 do
+   local x = r:get(k)
+   assert(c:info(k) == x:size(1) and (c:get(k) - x):abs():max() == 0, 'clip ' .. k .. ' changed')
+end
+r:close()
+c:close()
+os.remove(file)
+
+-- until its first close, an archive has no clips
+w = audio.ArchiveWriter(file, 'flac')
+w:add(clip(100, 1, 6), 16000)
+r = audio.Archive(file)
+assert(r:size() == 0)
+r:close()
+w:close()
+r = audio.Archive(file)
+assert(r:size() == 1)
+r:close()
+os.remove(file)
+print('ok')
@@ -0,0 +1,32 @@
+require 'audio'
+-- a pure tone at the centre frequency of a bin should peak in that bin,
+-- whichever octave it falls in, in single and double precision.
+-- Row r (1-based, lowest first) of octaves*bins rows is centred on
+-- fmax * 2^((r - octaves*bins) / bins)
+local rate, fmin, fmax, bins = 8000, 100, 3200, 12
+local octaves = 5 -- ceil(log2(fmax / fmin))
+local nrows = octaves * bins
+local n = 2 * rate
+for _, row in ipairs({6, 31, 56}) do
+   local f = fmax * 2 ^ ((row - nrows) / bins)
+   local tone = torch.range(0, n - 1):mul(2 * math.pi * f / rate):sin()
+   local spectra = {}
+   for _, t in ipairs({'torch.DoubleTensor', 'torch.FloatTensor'}) do
+      local c = audio.cqt(tone:type(t), fmin, fmax, bins, rate)
+      assert(torch.type(c) == t)
+      assert(c:size(1) == nrows and c:size(3) == 2)
+      -- magnitude over the middle half of the frames, away from the edges
+      local nframes = c:size(2)
+      local mid = c:double():narrow(2, math.floor(nframes / 4), math.floor(nframes / 2))
+      local magnitude = torch.pow(mid, 2):sum(3):sqrt():mean(2):view(nrows)
+      local _, peak = magnitude:max(1)
+      print(t, string.format('%.1f Hz', f), 'row', row, 'peak', peak[1])
+      assert(peak[1] == row, string.format('a %.1f Hz tone peaks in row %d, not %d',
+                                           f, peak[1], row))
+      spectra[t] = c:double()
+   end
+   local d = spectra['torch.DoubleTensor']
+   local err = (spectra['torch.FloatTensor'] - d):abs():max() / d:abs():max()
+   assert(err < 1e-4, 'float cqt differs from double cqt by ' .. err)
+end
+print('ok')
@@ -10,3 +10,34 @@ print('compressed')
 -- outf:writeChar(o:storage())
 -- outf:close()
 m2 = audio.decompress(o, 'ogg')
+-- compress output is a plain ogg file, and plain files decompress
+local file = os.tmpname() .. '.ogg'
+local f = torch.DiskFile(file, 'w'):binary()
+f:writeChar(o:storage())
+f:close()
+local m3 = audio.load(file)
+assert(m3:size(1) == m2:size(1))
+f = torch.DiskFile(file, 'r'):binary()
+local bytes = torch.CharTensor(f:readChar(o:nElement()))
+f:close()
+os.remove(file)
+assert((audio.decompress(bytes, 'ogg') - m2):abs():max() == 0)
+
+-- blobs from older versions of compress start with the number of samples
+-- (frames x channels) as a little-endian int64, and still decompress
+local function legacy(blob, count)
+   local old = torch.CharTensor(8 + blob:nElement())
+   for i = 1, 8 do
+      local byte = count % 256
+      old[i] = byte < 128 and byte or byte - 256
+      count = math.floor(count / 256)
+   end
+   old:narrow(1, 9, blob:nElement()):copy(blob)
+   return old
+end
+local count = m:size(1) * m:size(2)
+assert((audio.decompress(legacy(o, count), 'ogg') - m2):abs():max() == 0)
+local w = audio.compress(m, 22050, 'wav')
+local mw = audio.decompress(w, 'wav')
+assert((audio.decompress(legacy(w, count), 'wav') - mw):abs():max() == 0)
+print('ok')
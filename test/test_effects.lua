@@ -0,0 +1,18 @@
+require 'audio'
+-- effects run on load give what applyEffects gives on the loaded tensor
+local file = os.tmpname() .. '.wav'
+local x = torch.range(1, 2 * 16000):mul(0.02):sin():mul(2^29):view(-1, 2)
+audio.save(file, x, 16000)
+local voice, rate = audio.load(file)
+local effects = {{'gain', -6}, 'speed 1.1'}
+local loaded, loaded_rate = audio.load(file, {effects = effects, rate = 16000})
+local applied, applied_rate = audio.applyEffects(voice, rate, effects, {rate = 16000})
+os.remove(file)
+assert(loaded_rate == 16000 and applied_rate == 16000)
+assert(loaded:size(2) == 2 and math.abs(loaded:size(1) - 16000 / 1.1) < 100)
+assert((loaded - applied):abs():max() == 0)
+-- gain -6 halves the samples, near enough
+local half = audio.applyEffects(voice, rate, {'gain -6.0206'}, {mono = true})
+assert(half:size(2) == 1)
+assert((half:view(-1) - voice:mean(2):view(-1):div(2)):abs():max() < 2^17)
+print('ok')
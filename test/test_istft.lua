@@ -0,0 +1,29 @@
+require 'audio'
+-- istft should invert stft wherever the window sum is nonzero
+voice = audio.samplevoice():double():select(2, 1)
+voice:div(voice:abs():max())
+for _, cfg in ipairs({{1024, 'hamming', 256}, {1024, 'hann', 512}, {512, 'sqrthann', 256}}) do
+   local window_size, window, stride = unpack(cfg)
+   local spec = audio.stft(voice, window_size, window, stride)
+   local y = audio.istft(spec, window_size, window, stride)
+   local n = y:size(1)
+   local err = (y:narrow(1, 2, n - 2) - voice:narrow(1, 2, n - 2)):abs():max()
+   print(window, stride, err)
+   assert(err < 1e-8, 'istft(stft(x)) differs from x by ' .. err)
+
+   -- the streaming synthesis should produce the same samples
+   local stream = audio.ISTFTStream(window_size, window, stride)
+   local pieces = {}
+   local nframes = spec:size(1)
+   local first = 1
+   while first <= nframes do
+      local count = math.min(3, nframes - first + 1)
+      table.insert(pieces, stream:push(spec:narrow(1, first, count)):clone())
+      first = first + count
+   end
+   table.insert(pieces, stream:flush():clone())
+   local streamed = torch.cat(pieces, 1)
+   assert(streamed:size(1) == n)
+   assert((streamed - y):abs():max() < 1e-10)
+end
+print('ok')
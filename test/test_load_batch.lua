@@ -0,0 +1,71 @@
+require 'audio'
+-- a batch decodes each item as audio.load would, in the order given, and a
+-- broken item in the middle costs only its own slot
+local rate = 16000
+local lengths = {10007, 0, 4001, 6000}
+local channels = {2, 0, 1, 2}
+local paths, blobs = {}, {}
+for i = 1, #lengths do
+   paths[i] = os.tmpname() .. '.wav'
+   if lengths[i] > 0 then
+      local n, c = lengths[i], channels[i]
+      local x = torch.range(0, n * c - 1):mul(0.01 * i):sin():mul(2^30):round():view(n, c)
+      audio.save(paths[i], x, rate)
+      blobs[i] = audio.compress(x, rate, 'wav')
+   else
+      local f = io.open(paths[i], 'w')
+      f:write('not audio at all')
+      f:close()
+      blobs[i] = torch.CharTensor(64):fill(65)
+   end
+end
+local function reference(i)
+   return audio.load(paths[i])
+end
+
+for _, nthreads in ipairs({1, 3, 0}) do
+   for _, case in ipairs({{'load', paths}, {'decompress', blobs}}) do
+      local name, items = unpack(case)
+      local run = function(opts)
+         if name == 'load' then
+            return audio.loadBatch(items, nthreads, opts)
+         end
+         return audio.decompressBatch(items, 'wav', nthreads, opts)
+      end
+      local tensors, rates, errors = run()
+      assert(#rates == #items)
+      for i = 1, #items do
+         if lengths[i] == 0 then
+            assert(tensors[i] == false, name .. ': item ' .. i .. ' should have failed')
+            assert(type(errors[i]) == 'string' and #errors[i] > 0, name .. ': no error for item ' .. i)
+         else
+            assert(errors[i] == nil, name .. ': item ' .. i .. ': ' .. tostring(errors[i]))
+            assert(rates[i] == rate)
+            assert((tensors[i] - reference(i)):abs():max() == 0,
+                   name .. ': item ' .. i .. ' differs from audio.load')
+         end
+      end
+
+      local batch, len, _, perrors = run({pad = true})
+      assert(batch:size(1) == #items and batch:size(2) == 10007 and batch:size(3) == 2)
+      assert(perrors[2] and perrors[1] == nil)
+      for i = 1, #items do
+         assert(len[i] == lengths[i], name .. ': length ' .. len[i] .. ' for item ' .. i)
+         if lengths[i] > 0 then
+            local ref = reference(i)
+            local c = ref:size(2)
+            assert((batch[i]:narrow(1, 1, lengths[i]):narrow(2, 1, c) - ref):abs():max() == 0)
+         end
+         -- everything past the item's own samples and channels is zero
+         local padding = batch[i]:clone()
+         if lengths[i] > 0 then
+            padding:narrow(1, 1, lengths[i]):narrow(2, 1, channels[i]):zero()
+         end
+         assert(padding:abs():max() == 0, name .. ': padding of item ' .. i .. ' is not zero')
+      end
+   end
+end
+for i = 1, #paths do
+   os.remove(paths[i])
+end
+print('ok')
@@ -0,0 +1,77 @@
+require 'audio'
+-- the mel filterbank, probed one bin at a time: a cosine at the centre
+-- frequency of bin k, under a rect window, has power in bin k only, so
+-- melspectrogram / spectrogram gives column k of the filters
+local n, rate, n_mels = 512, 16000, 20
+local nbins = n / 2 + 1
+local tones = torch.DoubleTensor(nbins - 2, n)
+for k = 1, nbins - 2 do
+   tones[k]:copy(torch.range(0, n - 1):mul(2 * math.pi * k / n):cos())
+end
+local opts = {batch = true, n_mels = n_mels, mode = 'power'}
+local mel = audio.melspectrogram(tones, n, 'rect', n, rate, opts):select(3, 1)
+local power = audio.spectrogram(tones, n, 'rect', n, {batch = true, mode = 'power'}):select(3, 1)
+local filters = torch.zeros(n_mels, nbins)
+for k = 1, nbins - 2 do
+   -- spectrogram rows run from the highest bin down
+   filters:select(2, k + 1):copy(mel[k]):div(power[k][nbins - k])
+end
+
+-- the same triangles, from the formula in the docs
+local function hz_to_mel(f) return 2595 * math.log10(1 + f / 700) end
+local function mel_to_hz(m) return 700 * (10 ^ (m / 2595) - 1) end
+local top = hz_to_mel(rate / 2)
+local centre = {}
+for j = 0, n_mels + 1 do
+   centre[j] = mel_to_hz(top * j / (n_mels + 1))
+end
+local expected = torch.zeros(n_mels, nbins)
+for j = 1, n_mels do
+   for k = 0, nbins - 1 do
+      local f = k * rate / n
+      if f > centre[j - 1] and f < centre[j + 1] then
+         expected[j][k + 1] = f <= centre[j] and (f - centre[j - 1]) / (centre[j] - centre[j - 1])
+            or (centre[j + 1] - f) / (centre[j + 1] - centre[j])
+      end
+   end
+end
+local err = (filters - expected):narrow(2, 2, nbins - 2):abs():max()
+print('filterbank', err)
+assert(err < 1e-9, 'mel filters differ from the documented triangles by ' .. err)
+
+-- each triangle peaks at 1 at most, and between the first and last centre
+-- the filters covering a bin sum to 1
+assert(filters:max() <= 1 + 1e-9)
+for j = 1, n_mels do
+   assert(filters[j]:max() > 0.5, 'filter ' .. j .. ' covers no bin near its centre')
+end
+for k = 0, nbins - 1 do
+   local f = k * rate / n
+   if f >= centre[1] and f <= centre[n_mels] then
+      local sum = filters:select(2, k + 1):sum()
+      assert(math.abs(sum - 1) < 1e-9, 'filters sum to ' .. sum .. ' at ' .. f .. ' Hz')
+   end
+end
+
+-- mfcc is spectrogram -> mel -> log -> orthonormal DCT-II
+local voice = audio.samplevoice():double():select(2, 1)
+voice:div(voice:abs():max())
+local window_size, stride, n_mfcc = 512, 256, 13
+power = audio.spectrogram(voice, window_size, 'hann', stride, {mode = 'power'})
+local natural = power:index(1, torch.range(nbins, 1, -1):long())
+local logmel = (expected * natural):clamp(1e-10, math.huge):log()
+local dct = torch.DoubleTensor(n_mfcc, n_mels)
+for c = 0, n_mfcc - 1 do
+   local scale = math.sqrt((c == 0 and 1 or 2) / n_mels)
+   for m = 0, n_mels - 1 do
+      dct[c + 1][m + 1] = scale * math.cos(math.pi * c * (m + 0.5) / n_mels)
+   end
+end
+local ref = dct * logmel
+local mfcc = audio.mfcc(voice, window_size, 'hann', stride, rate,
+                        {n_mels = n_mels, n_mfcc = n_mfcc})
+assert(mfcc:size(1) == n_mfcc and mfcc:size(2) == ref:size(2))
+err = (mfcc - ref):abs():max() / ref:abs():max()
+print('mfcc', err)
+assert(err < 1e-8, 'mfcc differs from the reference by ' .. err)
+print('ok')
@@ -0,0 +1,26 @@
+require 'audio'
+-- a tone resampled between common rates should match the tone generated
+-- at the new rate, away from the edges
+local function tone(rate, n, freq)
+   return torch.range(0, n - 1):mul(2 * math.pi * freq / rate):sin()
+end
+for _, r in ipairs({{44100, 16000}, {8000, 48000}, {22050, 16000}, {48000, 44100}}) do
+   local from, to = r[1], r[2]
+   local x = tone(from, from, 1000)
+   local y = audio.resample(x, from, to)
+   assert(y:size(1) == math.ceil(from * to / from))
+   local ref = tone(to, y:size(1), 1000)
+   local m = math.floor(to / 10)
+   local err = (y:narrow(1, m, y:size(1) - 2 * m) - ref:narrow(1, m, y:size(1) - 2 * m)):abs():max()
+   print(from, to, err)
+   assert(err < 1e-3, 'resampled tone differs by ' .. err)
+end
+-- resampling on load gives the same samples as resampling afterwards
+local file = os.tmpname() .. '.wav'
+audio.save(file, tone(44100, 44100, 440):mul(2^30):view(-1, 1), 44100)
+local voice, rate = audio.load(file)
+local loaded, loaded_rate = audio.load(file, {rate = 16000})
+os.remove(file)
+assert(rate == 44100 and loaded_rate == 16000)
+assert((loaded - audio.resample(voice, rate, 16000)):abs():max() == 0)
+print('ok')
@@ -0,0 +1,24 @@
+require 'audio'
+-- the single precision path should stay close to the double precision one
+voice = audio.samplevoice():double()
+voice:div(voice:abs():max())
+for _, window in ipairs({'rect', 'hann', 'blackmanharris'}) do
+   for _, batched in ipairs({false, true}) do
+      local d = audio.stft(voice, 1024, window, 256, {batched=batched})
+      local f = audio.stft(voice:float(), 1024, window, 256, {batched=batched})
+      assert(torch.type(f) == 'torch.FloatTensor')
+      local err = (f:double() - d):abs():max() / d:abs():max()
+      print(window, batched, err)
+      assert(err < 1e-5, 'float stft differs from double stft by ' .. err)
+   end
+end
+-- opts.out is filled in place and returned; its storage is kept
+local opts = {out = torch.FloatTensor()}
+local ref = audio.stft(voice:float(), 1024, 'hann', 256)
+local out = audio.stft(voice:float(), 1024, 'hann', 256, opts)
+assert(out == opts.out)
+local data = torch.data(out)
+out = audio.stft(voice:float(), 1024, 'hann', 256, opts)
+assert(torch.data(out) == data)
+assert((out - ref):abs():max() == 0)
+print('ok')
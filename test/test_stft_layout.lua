@@ -0,0 +1,59 @@
+require 'audio'
+-- every layout stft can write should hold the default output, with its bins
+-- reversed, its dimensions permuted or its parts split off
+local voice = audio.samplevoice():double()
+voice:div(voice:abs():max())
+local window_size, stride = 512, 128
+local nbins = window_size / 2 + 1
+local reversed = torch.range(nbins, 1, -1):long()
+
+-- the default layout (frames x bins x 2, highest bin first) of one signal
+-- rearranged as order, major and complex ask
+local function expect(ref, order, major, complex)
+   local x = ref
+   if order == 'natural' then
+      x = x:index(2, reversed)
+   end
+   if major == 'bin' then
+      x = x:transpose(1, 2)
+   end
+   if complex == 'split' then
+      x = x:permute(3, 1, 2)
+   end
+   return x
+end
+
+for _, t in ipairs({'torch.DoubleTensor', 'torch.FloatTensor'}) do
+   local tolerance = t == 'torch.FloatTensor' and 1e-5 or 1e-12
+   local mono = voice:select(2, 1):narrow(1, 1, 16000):clone():type(t)
+   local backwards = mono:index(1, torch.range(16000, 1, -1):long())
+   local stereo = torch.cat(mono:view(-1, 1), backwards:view(-1, 1), 2)
+   for _, batched in ipairs({false, true}) do
+      local ref = audio.stft(mono, window_size, 'hann', stride, {batched = batched})
+      local refs = audio.stft(stereo, window_size, 'hann', stride, {batched = batched})
+      local scale = ref:abs():max()
+      for _, order in ipairs({'reversed', 'natural'}) do
+         for _, major in ipairs({'frame', 'bin'}) do
+            for _, complex in ipairs({'interleaved', 'split'}) do
+               local opts = {batched = batched, order = order, major = major, complex = complex}
+               local y = audio.stft(mono, window_size, 'hann', stride, opts)
+               local x = expect(ref, order, major, complex)
+               assert(y:isSameSizeAs(x), string.format('%s %s %s: wrong size', order, major, complex))
+               local err = (y - x):abs():max() / scale
+               print(t, batched, order, major, complex, err)
+               assert(err < tolerance, string.format('%s %s %s differs by %g',
+                                                     order, major, complex, err))
+               -- multi-channel output leads with the channel, each in that layout
+               local ys = audio.stft(stereo, window_size, 'hann', stride, opts)
+               assert(ys:size(1) == stereo:size(2))
+               for c = 1, stereo:size(2) do
+                  err = (ys[c] - expect(refs[c], order, major, complex)):abs():max() / scale
+                  assert(err < tolerance, string.format('channel %d of %s %s %s differs by %g',
+                                                        c, order, major, complex, err))
+               end
+            end
+         end
+      end
+   end
+end
+print('ok')
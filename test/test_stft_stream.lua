@@ -0,0 +1,46 @@
+require 'audio'
+-- frames pushed out of a stream, chunk by uneven chunk, should be the stft
+-- of the whole signal, and flush the frames of that signal zero-padded
+local voice = audio.samplevoice():double():select(2, 1)
+voice:div(voice:abs():max())
+local chunks = {1, 37, 160, 1023, 5, 2048, 441}
+for _, t in ipairs({'torch.DoubleTensor', 'torch.FloatTensor'}) do
+   for _, cfg in ipairs({{1024, 'hann', 256}, {512, 'hamming', 160}, {256, 'rect', 300}}) do
+      local window_size, window, stride = unpack(cfg)
+      local x = voice:narrow(1, 1, 20000 + stride - 1):type(t)
+      local n = x:size(1)
+      local stream = audio.STFTStream(window_size, window, stride)
+      local pushed = {}
+      local first, i = 1, 0
+      while first <= n do
+         i = i % #chunks + 1
+         local count = math.min(chunks[i], n - first + 1)
+         local frames = stream:push(x:narrow(1, first, count))
+         if frames:nElement() > 0 then
+            -- the returned tensor is reused by the next push
+            table.insert(pushed, frames:clone())
+         end
+         first = first + count
+      end
+      assert(stream:pending() > 0)
+      local flushed = stream:flush():clone()
+      assert(flushed:nDimension() == 3 and stream:pending() == 0)
+
+      local tolerance = t == 'torch.FloatTensor' and 1e-5 or 1e-10
+      local ref = audio.stft(x, window_size, window, stride)
+      pushed = torch.cat(pushed, 1)
+      assert(pushed:size(1) == ref:size(1), 'pushed ' .. pushed:size(1)
+                .. ' frames, stft has ' .. ref:size(1))
+      local err = (pushed - ref):abs():max() / ref:abs():max()
+      print(t, window, stride, 'push', err)
+      assert(err < tolerance, 'pushed frames differ from stft by ' .. err)
+
+      local padded = torch.cat(x, x.new(window_size):zero(), 1)
+      local all = audio.stft(padded, window_size, window, stride)
+      local tail = all:narrow(1, ref:size(1) + 1, flushed:size(1))
+      err = (flushed - tail):abs():max() / ref:abs():max()
+      print(t, window, stride, 'flush', err)
+      assert(err < tolerance, 'flushed frames differ from stft by ' .. err)
+   end
+end
+print('ok')
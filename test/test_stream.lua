@@ -0,0 +1,42 @@
+require 'audio'
+-- a file streamed chunk by chunk, for chunk sizes that do not divide its
+-- length, should concatenate to what audio.load returns for it
+local file = os.tmpname() .. '.wav'
+local n, rate = 10007, 16000
+local x = torch.range(0, 2 * n - 1):mul(0.01):sin():mul(2^30):round():view(n, 2)
+audio.save(file, x, rate)
+local ref = audio.load(file)
+assert(ref:size(1) == n and ref:size(2) == 2)
+
+for _, chunk_frames in ipairs({1, 997, 4096, n, n + 5}) do
+   local chunks = {}
+   local iterator, handle = audio.stream(file, chunk_frames)
+   assert(handle:rate() == rate, 'rate ' .. handle:rate())
+   assert(handle:channels() == 2, 'channels ' .. handle:channels())
+   assert(handle:length() == n, 'length ' .. handle:length())
+   for chunk in iterator do
+      assert(chunk:nDimension() == 2 and chunk:size(2) == 2)
+      table.insert(chunks, chunk)
+   end
+   local nchunks = math.ceil(n / chunk_frames)
+   assert(#chunks == nchunks, chunk_frames .. ': ' .. #chunks .. ' chunks, not ' .. nchunks)
+   for i = 1, nchunks - 1 do
+      assert(chunks[i]:size(1) == chunk_frames)
+   end
+   -- only the last chunk is short
+   local last = n - (nchunks - 1) * chunk_frames
+   assert(chunks[nchunks]:size(1) == last, 'last chunk of ' .. chunks[nchunks]:size(1)
+             .. ' frames, not ' .. last)
+   local all = torch.cat(chunks, 1)
+   assert((all - ref):abs():max() == 0, chunk_frames .. ': streamed samples differ from load')
+end
+
+-- a window of the file streams the same window audio.load returns
+local window = {offset = 123, length = 5000}
+local chunks = {}
+for chunk in audio.stream(file, 999, window) do
+   table.insert(chunks, chunk)
+end
+assert((torch.cat(chunks, 1) - audio.load(file, window)):abs():max() == 0)
+os.remove(file)
+print('ok')
@@ -0,0 +1,24 @@
+require 'audio'
+-- 16 bit PCM WAV is read from a mapping: every type and window must agree
+-- with the samples that were saved
+local file = os.tmpname() .. '.wav'
+local n, rate = 10007, 16000
+local x = torch.range(0, 2 * n - 1):mul(0.01):sin():mul(30000):round():view(n, 2)
+audio.save(file, x:clone():mul(65536), rate, {bits = 16})
+
+local s, r = audio.load(file, {type = 'torch.ShortTensor'})
+assert(r == rate and s:size(1) == n and s:size(2) == 2)
+assert((s:double() - x):abs():max() == 0)
+
+local f = audio.load(file, {type = 'torch.FloatTensor', normalize = true, offset = 100, length = 500})
+assert((f:double():mul(32768) - x:narrow(1, 101, 500)):abs():max() == 0)
+
+local v = audio.load(file, {type = 'torch.ShortTensor', offset = 7})
+assert(v:size(1) == n - 7 and (v:double() - x:narrow(1, 8, n - 7)):abs():max() == 0)
+v:zero() -- the mapping is private: the file is unchanged
+assert((audio.load(file, {type = 'torch.ShortTensor'}):double() - x):abs():max() == 0)
+
+local m = audio.load(file, {channels = 2, type = 'torch.IntTensor'})
+assert((m:double():div(65536) - x:narrow(2, 2, 1)):abs():max() == 0)
+os.remove(file)
+print('ok')